@@ -0,0 +1,125 @@
+-- Benchmarks for marshal: lua bench.lua [pattern [seconds]]
+--
+-- Each case is run for encode, decode and clone until at least `seconds`
+-- (default 0.5) of CPU time have passed. Reported per operation: ops/s,
+-- MB/s of encoded data and the Lua heap allocated, with the collector
+-- stopped while measuring.
+
+local marshal = require "marshal"
+
+local pattern = arg and arg[1] or ""
+local seconds = tonumber(arg and arg[2]) or 0.5
+
+local cases = { }
+local function case(name, value, constants, options)
+   cases[#cases + 1] = { name = name, value = value, constants = constants, options = options }
+end
+
+-- one small record, the old micro-bench from test.lua
+case("small", { a='a', b='b', c='c', d='d', hop='jump', skip='foo', answer=42 })
+
+local wide = { }
+for i=1, 100000 do wide[i] = i * 1.5 end
+case("wide", wide)
+case("wide/compact", wide, nil, { compact = true })
+
+local deep = { }
+local node = deep
+for i=1, 1000 do
+   node.next = { depth = i }
+   node = node.next
+end
+case("deep", deep)
+
+local graph = { }
+for i=1, 2000 do graph[i] = { id = i } end
+for i=1, 2000 do
+   local n = graph[i]
+   n.prev = graph[i == 1 and 2000 or i - 1]
+   n.next = graph[i == 2000 and 1 or i + 1]
+   n.peer = graph[(i * 7) % 2000 + 1]
+end
+case("refs", graph)
+
+local records = { }
+for i=1, 5000 do
+   records[i] = {
+      name = "user"..i, email = "user"..i.."@example.com",
+      city = ({ "Berlin", "Paris", "Lisbon", "Oslo" })[i % 4 + 1], status = "active",
+   }
+end
+case("strings", records)
+case("strings/intern", records, nil, { intern = true })
+case("strings/shapes", records, nil, { shapes = true })
+case("strings/compress", records, nil, { compress = true })
+
+local closures = { }
+for i=1, 500 do
+   local count, step = 0, i
+   closures[i] = {
+      inc = function() count = count + step return count end,
+      get = function() return count end,
+   }
+end
+case("closures", closures)
+
+local Point = { }
+Point.__index = Point
+function Point:__persist()
+   local x, y = self.x, self.y
+   return function()
+      return setmetatable({ x = x, y = y }, Point)
+   end
+end
+local points = { }
+for i=1, 1000 do points[i] = setmetatable({ x = i, y = -i }, Point) end
+case("persist", points, { Point })
+
+local clock = os.clock
+
+-- runs f in rounds with the collector stopped, doubling the calls per
+-- round until a round takes long enough for the clock to be meaningful
+local function round(f, reps)
+   collectgarbage()
+   collectgarbage("stop")
+   local mem = collectgarbage("count")
+   local t0 = clock()
+   for _=1, reps do f() end
+   local t = clock() - t0
+   local kb = collectgarbage("count") - mem
+   collectgarbage("restart")
+   return t, kb
+end
+
+local function measure(f)
+   local reps = 1
+   local t, kb = round(f, reps)
+   while t < 0.01 do
+      reps = reps * 2
+      t, kb = round(f, reps)
+   end
+   local n, total, heap = reps, t, kb
+   while total < seconds do
+      t, kb = round(f, reps)
+      n, total, heap = n + reps, total + t, heap + kb
+   end
+   return n / total, heap / n
+end
+
+local function report(name, op, ops, size, kb)
+   print(string.format("%-18s %-7s %12.1f ops/s %10.2f MB/s %12.1f KB/op",
+      name, op, ops, ops * size / 1e6, kb))
+end
+
+for _, c in ipairs(cases) do
+   if string.find(c.name, pattern, 1, true) then
+      local v, k, o = c.value, c.constants, c.options
+      local s = marshal.encode(v, k, o)
+      local ops, kb = measure(function() marshal.encode(v, k, o) end)
+      report(c.name, "encode", ops, #s, kb)
+      local ops, kb = measure(function() marshal.decode(s, k) end)
+      report(c.name, "decode", ops, #s, kb)
+      local ops, kb = measure(function() marshal.clone(v, k) end)
+      report(c.name, "clone", ops, #s, kb)
+   end
+end
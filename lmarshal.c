@@ -29,6 +29,8 @@
 * OTHER DEALINGS IN THE SOFTWARE.
 */
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
@@ -37,43 +39,502 @@
 #include "lualib.h"
 #include "lauxlib.h"
 
+#include "lmarshal.h"
+
+/* Built with MAR_THREADS (and linked with -lpthread), the threads option
+ * compresses the blocks of a value on several threads. */
+#ifdef MAR_THREADS
+#include <pthread.h>
+#define MAR_THREADS_MAX 64
+#endif
+
+/* decode_file maps the file where it can, and reads it in anywhere else */
+#if defined(__unix__) || defined(__APPLE__)
+#define MAR_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if LUA_VERSION_NUM >= 502
+#define lua_objlen(L, i)        lua_rawlen(L, (i))
+#define lua_getfenv(L, i)       lua_getuservalue(L, (i))
+#define lua_setfenv(L, i)       lua_setuservalue(L, (i))
+#define luaL_reg                luaL_Reg
+#define luaL_register(L, n, l)  luaL_setfuncs(L, (l), 0)
+#endif
+
+#if LUA_VERSION_NUM >= 503
+#define mar_dump(L, w, d)       lua_dump(L, (w), (d), 0)
+#define mar_pushint(L, i)       lua_pushinteger(L, (lua_Integer)(i))
+#else
+#define mar_dump(L, w, d)       lua_dump(L, (w), (d))
+#define mar_pushint(L, i)       lua_pushnumber(L, (lua_Number)(i))
+#endif
+
 
 #define MAR_TREF 1
 #define MAR_TVAL 2
 #define MAR_TUSR 3
+#define MAR_TPRO 4   /* closure of an already written function prototype */
+#define MAR_TSHP 5   /* table with the keys of a shape, followed by its values */
+#define MAR_TPKD 6   /* array of floats, integers or strings without type bytes */
+#define MAR_TNAT 7   /* userdata written by the C hook of its metatable */
+
+/* extended value types, written in place of the Lua type byte */
+#define MAR_TINT 0x10   /* integral number as a zigzag varint */
+#define MAR_TSTR 0x11   /* string, also added to the seen table */
+#define MAR_TSRF 0x12   /* reference to a string in the seen table */
 
 #define MAR_CHR 1
 #define MAR_I32 4
+#define MAR_VAR32 5  /* widest varint of a MAR_I32 field */
 #define MAR_I64 8
 
-#define MAR_MAGIC 0x8e
+/* the magic byte is the format version: 0x8e was the layout before table
+ * bodies had counts */
+#define MAR_MAGIC 0x8f
+#define MAR_MAGIC_OLD 0x8e
 #define SEEN_IDX  3
 
+/* format flags, written after the magic byte when any are set */
+#define MAR_FHEAD    0x80
+#define MAR_FCOMPACT 0x01
+#define MAR_FSTREAM  0x02
+#define MAR_FINDEX   0x04   /* an index of the top-level keys follows the value */
+#define MAR_FLZ      0x08   /* the rest is in compressed blocks */
+#define MAR_FMANY    0x10   /* a count and that many values follow */
+#define MAR_FSHARE   0x20   /* the values of a batch may refer to each other */
+#define MAR_FDIFF    0x40   /* the value is a tree of edits for patch */
+#define MAR_FALL     (MAR_FCOMPACT | MAR_FSTREAM | MAR_FINDEX | MAR_FLZ \
+                    | MAR_FMANY | MAR_FSHARE | MAR_FDIFF)
+
+/* size of the header when it has flags */
+#define MAR_HEAD_SIZE 2
+
+#define mar_is_lz(h) ((unsigned char)(h)[0] == MAR_MAGIC \
+    && ((unsigned char)(h)[1] & MAR_FHEAD) && ((unsigned char)(h)[1] & MAR_FLZ))
+
+#define MAR_CHUNK_SIZE 16384
+
+#define MAR_BLOCK_SIZE 65536
+#define MAR_LZ_HBITS   12
+#define MAR_LZ_HSIZE   (1 << MAR_LZ_HBITS)
+#define MAR_LZ_LIMIT   12   /* no match starts in the last bytes of a block */
+#define MAR_LZ_HEAD    3    /* most bytes a block length takes as a varint */
+
+#define MAR_INTERN_MIN 4
+
+/* kinds of packed arrays, and the shortest array that is packed */
+#define MAR_PNUM 1
+#define MAR_PINT 2
+#define MAR_PSTR 3
+#define MAR_PACK_MIN 8
+#define MAR_PACK_CHUNK 512
+
+#define MAR_ENCODER "marshal.encoder"
+#define MAR_DECODER "marshal.decoder"
+#define MAR_BUFFER  "marshal.buffer"
+#define MAR_VIEW    "marshal.view"
+#define MAR_CONSTANTS "marshal.constants"
+#define MAR_FILE    "marshal.file"
+#define MAR_MAP     "marshal.map"
+#define MAR_ARENA   "marshal.arena"
+#define MAR_CHANNEL "marshal.channel"
+
+/* stack slots of the decoder's current object and pending key */
+#define MAR_T_IDX 4
+#define MAR_K_IDX 5
+
+/* decoder frame kinds */
+#define MAR_KTABLE   0
+#define MAR_KPERSIST 1   /* payload of a __persist closure */
+#define MAR_KUPVALS  2   /* upvalue list of a function */
+#define MAR_KSHAPE   3   /* table written with a shape */
+
+/* input states of a decoder */
+#define MAR_ZHEAD  0   /* header not seen yet */
+#define MAR_ZRAW   1
+#define MAR_ZBLOCK 2   /* compressed blocks */
+#define MAR_ZEND   3   /* final block seen */
+
+/* decoder frame states */
+#define MAR_SHEAD 0   /* body header not read yet */
+#define MAR_SARR  1
+#define MAR_SKEY  2
+#define MAR_SVAL  3
+#define MAR_SSHP  4   /* values of a shaped table */
+
+/* results of reading a value */
+#define MAR_MORE  0
+#define MAR_VALUE 1
+#define MAR_FRAME 2
+
+#define MAR_FRAMES 16
+
+/* Built with MAR_STATS defined, encodes keep counts in mar_stats, which
+ * marshal.stats() returns. Otherwise mar_stat() compiles to nothing. The
+ * counts are plain globals, so they can't be kept while other threads
+ * encode too. */
+#ifdef MAR_STATS
+#ifdef MAR_THREADS
+#error "MAR_STATS can't be combined with MAR_THREADS"
+#endif
+#include <time.h>
+
+typedef struct mar_Stats {
+    size_t encodes;
+    size_t bytes[LUA_TTHREAD + 1];  /* written per type, bodies excluded */
+    size_t tables;
+    size_t functions;
+    size_t persisted;   /* objects with a __persist hook */
+    size_t refs;        /* MAR_TREF to an object written before */
+    size_t strrefs;     /* MAR_TSRF to an interned string */
+    size_t protos;      /* MAR_TPRO to a function prototype */
+    size_t reallocs;    /* buffer growth */
+    size_t depth;       /* deepest nesting of bodies */
+    size_t flushed;     /* bytes handed to sinks, for byte counts */
+    clock_t persist_time;
+} mar_Stats;
+
+static mar_Stats mar_stats;
+
+#define mar_stat(x) (x)
+#define mar_stat_pos(buf) (mar_stats.flushed + (buf)->head)
+#else
+#define mar_stat(x) ((void)0)
+#endif
+
+typedef void (*mar_Sink)(lua_State *L, void *ud, const char *data, size_t len);
+
+/* Memory for one call. Small allocations are bumped out of shared blocks,
+ * and the latest one grows in place; large ones get a block each, which is
+ * resized with the state's allocator. Everything goes back in one go when
+ * the call is done, or when the arena is collected after an error. */
+typedef struct mar_Block {
+    struct mar_Block *prev;
+    struct mar_Block *next;
+    size_t size;    /* bytes after the header */
+    size_t used;
+} mar_Block;
+
+typedef struct mar_Arena {
+    mar_Block *small;   /* allocations are bumped from the first */
+    mar_Block *large;
+    char *last;         /* latest small allocation */
+} mar_Arena;
+
+#define MAR_ARENA_BLOCK 8192
+#define MAR_ARENA_LARGE (MAR_ARENA_BLOCK / 4)
+#define mar_align(n)    (((n) + 7) & ~(size_t)7)
+#define MAR_BLOCK_HEAD  mar_align(sizeof(mar_Block))
+#define block_data(b)   ((char*)(b) + MAR_BLOCK_HEAD)
+
 typedef struct mar_Buffer {
     size_t size;
     size_t seek;
     size_t head;
     char*  data;
+    mar_Sink sink;  /* when set, the buffer is flushed here as it fills */
+    void*  sink_ud;
+    mar_Arena *arena;   /* where data comes from, NULL for the state's allocator */
 } mar_Buffer;
 
-static int mar_encode_table(lua_State *L, mar_Buffer *buf, size_t *idx);
-static int mar_decode_table(lua_State *L, const char* buf, size_t len, size_t *idx);
+/* Tables, functions and userdata already written, keyed by address, in an
+ * open addressing hash. A slot with idx 0 is empty. */
+typedef struct mar_Slot {
+    const void *p;
+    size_t idx;
+} mar_Slot;
+
+typedef struct mar_Seen {
+    size_t count;
+    size_t mask;    /* number of slots - 1 */
+    mar_Slot *slots;
+    mar_Arena *arena;
+} mar_Seen;
+
+typedef struct mar_Ctx {
+    size_t idx;
+    int    flags;
+    size_t strmin;  /* shortest string to intern, 0 to disable */
+    size_t nprotos; /* function prototypes written or read so far */
+    int    shapes;  /* write runs of tables with the same keys as shapes */
+    int    portable; /* data only, no bytecode */
+    int    threads;  /* most threads compressing at once */
+    size_t nshapes;
+    mar_Buffer *scratch;
+    mar_Buffer *index;  /* entries of the index, while encoding the root table */
+    mar_Seen *objs;
+    mar_Seen *consts;   /* objects of a marshal.constants, if given one */
+    mar_Arena *arena;   /* memory of the call, NULL for long lived objects */
+} mar_Ctx;
+
+/* A constants table entered once for any number of calls. Its environment
+ * holds the list, and the seen index of each string in it. */
+typedef struct mar_Constants {
+    size_t n;
+    mar_Seen objs;
+} mar_Constants;
+
+typedef struct mar_Encoder {
+    mar_Buffer buf;
+    mar_Buffer code;  /* scratch space for dumped functions */
+    mar_Seen objs;
+    int dirty;
+    mar_Ctx opts;
+} mar_Encoder;
+
+typedef struct mar_Frame {
+    int    kind;
+    int    state;
+    size_t narr;   /* items left, framed bodies only */
+    size_t nrec;
+    size_t i;      /* next array index */
+    size_t end;    /* input offset at which a framed body ends */
+    size_t ref;    /* seen index of the object */
+} mar_Frame;
+
+/* The encoder walks the value with an explicit stack of the bodies being
+ * written. The table of the top body sits in the slot after the work table
+ * st->w, then the last key it was iterated to and the previous entry (or
+ * shape keys). Opening body d saves the parent's three slots in the work
+ * table at 3d+1..3d+3. */
+typedef struct mar_Body {
+    int    kind;    /* MAR_KTABLE, or MAR_KSHAPE for the values of a shape */
+    int    state;
+    size_t mark;    /* size of the whole value */
+    size_t start;   /* output offset of the first entry */
+    size_t narr;    /* array entries, or keys of a shape */
+    size_t nrec;    /* hash entries left to write */
+    size_t i;       /* next array index, or next key of a shape */
+    size_t shape;   /* shape of the previous entry, or 0 */
+    mar_Buffer *index;
+} mar_Body;
+
+typedef struct mar_Stack {
+    int    w;
+    size_t depth;
+    size_t nbodies;
+    mar_Body *bodies;
+    mar_Body inline_bodies[MAR_FRAMES];
+} mar_Stack;
+
+typedef struct mar_Decoder {
+    mar_Ctx ctx;
+    const char *data;   /* input, with data[pos] the next byte to read */
+    size_t len;
+    size_t pos;
+    size_t offset;      /* input offset of data[0] */
+    int    header;      /* 0 before the magic, 1 before the flags, 2 after */
+    int    done;
+    int    failed;
+    int    many;        /* reading a batch */
+    int    delta;       /* reading a delta */
+    int    outside;     /* stopped at a ref into [lo, hi), proto <= plim
+                           or shape <= slim */
+    size_t lo;
+    size_t hi;
+    size_t plim;
+    size_t slim;
+    size_t depth;
+    size_t nframes;
+    mar_Frame *frames;
+    mar_Frame inline_frames[MAR_FRAMES];
+    mar_Buffer in;      /* pending input of a decoder object */
+    int    zstate;
+    int    nzhead;
+    char   zhead[MAR_HEAD_SIZE];
+    mar_Buffer z;       /* incomplete compressed block */
+} mar_Decoder;
+
+#define dec_avail(d) ((d)->len - (d)->pos)
+
+typedef struct mar_View {
+    const char *data;
+    size_t len;
+    int    flags;
+    size_t base;    /* seen index of the first object in the input */
+    size_t start;   /* offset of the value */
+    size_t n;       /* offsets of the tables and interned strings */
+    size_t cap;
+    size_t *offs;
+} mar_View;
+
+static char mar_protos_key;
+static char mar_scratch_key;
+static char mar_frames_key;
+static char mar_view_key;
+static char mar_shapes_key;
+static char mar_constants_key;
+static char mar_persist_key;
+
+/* allocates through the state's allocator, so that limits on the memory
+ * of a state cover the library too */
+static void *mar_lalloc(lua_State *L, void *p, size_t osize, size_t nsize)
+{
+    void *ud;
+    lua_Alloc f = lua_getallocf(L, &ud);
+    void *q = f(ud, p, p ? osize : 0, nsize);
+    if (!q && nsize) luaL_error(L, "Out of memory!");
+    return q;
+}
+
+static mar_Block *arena_block(lua_State *L, mar_Block **list, size_t size)
+{
+    mar_Block *b;
+    if (size > (size_t)-1 - MAR_BLOCK_HEAD) luaL_error(L, "Out of memory!");
+    b = (mar_Block*)mar_lalloc(L, NULL, 0, MAR_BLOCK_HEAD + size);
+    b->prev = NULL;
+    b->next = *list;
+    if (b->next) b->next->prev = b;
+    b->size = size;
+    b->used = 0;
+    *list = b;
+    return b;
+}
+
+static void arena_unlink(mar_Arena *a, mar_Block *b)
+{
+    if (b->prev) b->prev->next = b->next;
+    else a->large = b->next;
+    if (b->next) b->next->prev = b->prev;
+}
+
+/* realloc for memory of an arena; whether p has a block to itself follows
+ * from its old size */
+static void *arena_realloc(lua_State *L, mar_Arena *a, void *p, size_t osize, size_t nsize)
+{
+    mar_Block *b;
+    char *q;
+    if (p && osize > MAR_ARENA_LARGE) {
+        b = (mar_Block*)((char*)p - MAR_BLOCK_HEAD);
+        if (nsize > MAR_ARENA_LARGE) {
+            mar_Block *prev = b->prev, *next = b->next;
+            if (nsize > (size_t)-1 - MAR_BLOCK_HEAD) luaL_error(L, "Out of memory!");
+            b = (mar_Block*)mar_lalloc(L, b, MAR_BLOCK_HEAD + b->size, MAR_BLOCK_HEAD + nsize);
+            b->size = nsize;
+            if (prev) prev->next = b;
+            else a->large = b;
+            if (next) next->prev = b;
+            return block_data(b);
+        }
+        q = nsize ? (char*)arena_realloc(L, a, NULL, 0, nsize) : NULL;
+        if (q) memcpy(q, p, nsize);
+        arena_unlink(a, b);
+        mar_lalloc(L, b, MAR_BLOCK_HEAD + b->size, 0);
+        return q;
+    }
+    b = a->small;
+    if (p && (char*)p == a->last) {
+        size_t start = a->last - block_data(b);
+        if (nsize == 0 || (nsize <= MAR_ARENA_LARGE && mar_align(nsize) <= b->size - start)) {
+            b->used = start + mar_align(nsize);
+            if (nsize == 0) a->last = NULL;
+            return nsize ? p : NULL;
+        }
+    }
+    if (nsize == 0) return NULL;
+    if (nsize > MAR_ARENA_LARGE) {
+        q = block_data(arena_block(L, &a->large, nsize));
+    }
+    else {
+        if (!b || b->size - b->used < mar_align(nsize)) {
+            b = arena_block(L, &a->small, MAR_ARENA_BLOCK);
+        }
+        q = block_data(b) + b->used;
+        b->used += mar_align(nsize);
+        a->last = q;
+    }
+    if (p) memcpy(q, p, osize < nsize ? osize : nsize);
+    return q;
+}
+
+/* Stands for malloc in place of an arena, for buffers that leave the state
+ * (see lmarshal.h), whichever state or thread ends up freeing them. */
+static mar_Arena mar_heap;
+#define MAR_HEAP (&mar_heap)
+
+static void *mar_realloc(lua_State *L, mar_Arena *a, void *p, size_t osize, size_t nsize)
+{
+    if (a == MAR_HEAP) {
+        void *q;
+        if (nsize == 0) {
+            free(p);
+            return NULL;
+        }
+        if (!(q = realloc(p, nsize))) luaL_error(L, "Out of memory!");
+        return q;
+    }
+    if (a) return arena_realloc(L, a, p, osize, nsize);
+    return mar_lalloc(L, p, osize, nsize);
+}
+
+/* gives the blocks back; the arena can still be used after */
+static void arena_release(lua_State *L, mar_Arena *a)
+{
+    mar_Block *b;
+    while ((b = a->small) != NULL) {
+        a->small = b->next;
+        mar_lalloc(L, b, MAR_BLOCK_HEAD + b->size, 0);
+    }
+    while ((b = a->large) != NULL) {
+        a->large = b->next;
+        mar_lalloc(L, b, MAR_BLOCK_HEAD + b->size, 0);
+    }
+    a->last = NULL;
+}
+
+static mar_Arena *mar_push_arena(lua_State *L)
+{
+    mar_Arena *a = (mar_Arena*)lua_newuserdata(L, sizeof(mar_Arena));
+    a->small = NULL;
+    a->large = NULL;
+    a->last = NULL;
+    luaL_getmetatable(L, MAR_ARENA);
+    lua_setmetatable(L, -2);
+    return a;
+}
 
-static void buf_init(lua_State *L, mar_Buffer *buf)
+static void buf_init(lua_State *L, mar_Buffer *buf, mar_Arena *arena)
 {
     buf->size = 128;
     buf->seek = 0;
     buf->head = 0;
-    if (!(buf->data = malloc(buf->size))) luaL_error(L, "Out of memory!");
+    buf->sink = NULL;
+    buf->sink_ud = NULL;
+    buf->arena = arena;
+    buf->data = (char*)mar_realloc(L, arena, NULL, 0, buf->size);
 }
 
+/* Frees the memory of the buffer unless an arena owns it. This is also
+ * reached from __gc, after the arena may be gone, so it is not touched. */
 static void buf_done(lua_State* L, mar_Buffer *buf)
 {
-    free(buf->data);
+    if (!buf->arena) mar_lalloc(L, buf->data, buf->size, 0);
+    else if (buf->arena == MAR_HEAP) free(buf->data);
+}
+
+static void buf_flush(lua_State *L, mar_Buffer *buf)
+{
+    if (buf->head > 0) {
+        buf->sink(L, buf->sink_ud, buf->data, buf->head);
+        mar_stat(mar_stats.flushed += buf->head);
+        buf->head = 0;
+    }
 }
 
 static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
 {
+    if (buf->sink && buf->size - buf->head < len) {
+        buf_flush(L, buf);
+        if (len >= buf->size) {
+            buf->sink(L, buf->sink_ud, str, len);
+            mar_stat(mar_stats.flushed += len);
+            return 0;
+        }
+    }
     if (len > UINT32_MAX) luaL_error(L, "buffer too long");
     if (buf->size - buf->head < len) {
         size_t new_size = buf->size << 1;
@@ -81,9 +542,8 @@ static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
         while (new_size - cur_head <= len) {
             new_size = new_size << 1;
         }
-        if (!(buf->data = realloc(buf->data, new_size))) {
-            luaL_error(L, "Out of memory!");
-        }
+        buf->data = (char*)mar_realloc(L, buf->arena, buf->data, buf->size, new_size);
+        mar_stat(mar_stats.reallocs++);
         buf->size = new_size;
     }
     memcpy(&buf->data[buf->head], str, len);
@@ -91,455 +551,4958 @@ static int buf_write(lua_State* L, const char* str, size_t len, mar_Buffer *buf)
     return 0;
 }
 
-static const char* buf_read(lua_State *L, mar_Buffer *buf, size_t *len)
+static void buf_reserve(lua_State *L, mar_Buffer *buf, size_t size)
 {
-    if (buf->seek < buf->head) {
-        buf->seek = buf->head;
-        *len = buf->seek;
-        return buf->data;
+    if (buf->size < size) {
+        buf->data = (char*)mar_realloc(L, buf->arena, buf->data, buf->size, size);
+        mar_stat(mar_stats.reallocs++);
+        buf->size = size;
     }
-    *len = 0;
-    return NULL;
 }
 
-static void mar_encode_value(lua_State *L, mar_Buffer *buf, int val, size_t *idx)
+/* Fixed width fields are little-endian whatever the byte order of the
+ * host, and numbers are IEEE doubles, so their bytes mean the same
+ * everywhere. Loads go byte by byte and don't care about alignment. */
+static void mar_put32(char *s, uint32_t v)
 {
-    size_t l;
-    int val_type = lua_type(L, val);
-    lua_pushvalue(L, val);
+    unsigned char *p = (unsigned char*)s;
+    p[0] = (unsigned char)(v & 0xff);
+    p[1] = (unsigned char)((v >> 8) & 0xff);
+    p[2] = (unsigned char)((v >> 16) & 0xff);
+    p[3] = (unsigned char)((v >> 24) & 0xff);
+}
 
-    buf_write(L, (void*)&val_type, MAR_CHR, buf);
-    switch (val_type) {
-    case LUA_TBOOLEAN: {
-        int int_val = lua_toboolean(L, -1);
-        buf_write(L, (void*)&int_val, MAR_CHR, buf);
-        break;
-    }
-    case LUA_TSTRING: {
-        const char *str_val = lua_tolstring(L, -1, &l);
-        buf_write(L, (void*)&l, MAR_I32, buf);
-        buf_write(L, str_val, l, buf);
-        break;
-    }
-    case LUA_TNUMBER: {
-        lua_Number num_val = lua_tonumber(L, -1);
-        buf_write(L, (void*)&num_val, MAR_I64, buf);
-        break;
+static uint32_t mar_get32(const char *s)
+{
+    const unsigned char *p = (const unsigned char*)s;
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+         | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void mar_put64(char *s, uint64_t v)
+{
+    int i;
+    for (i = 0; i < MAR_I64; i++) {
+        s[i] = (char)(unsigned char)((v >> (8 * i)) & 0xff);
     }
-    case LUA_TTABLE: {
-        int tag, ref;
-        lua_pushvalue(L, -1);
-        lua_rawget(L, SEEN_IDX);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
-        }
-        else {
-            mar_Buffer rec_buf;
-            lua_pop(L, 1); /* pop nil */
-            if (luaL_getmetafield(L, -1, "__persist")) {
-                tag = MAR_TUSR;
+}
 
-                lua_pushvalue(L, -2); /* self */
-                lua_call(L, 1, 1);
-                if (!lua_isfunction(L, -1)) {
-                    luaL_error(L, "__persist must return a function");
-                }
+static void mar_put_num(char *s, lua_Number n)
+{
+    double d = (double)n;
+    uint64_t v;
+    memcpy(&v, &d, MAR_I64);
+    mar_put64(s, v);
+}
 
-                lua_remove(L, -2); /* __persist */
+static lua_Number mar_get_num(const char *s)
+{
+    const unsigned char *p = (const unsigned char*)s;
+    uint64_t v = 0;
+    double d;
+    int i;
+    for (i = MAR_I64 - 1; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    memcpy(&d, &v, MAR_I64);
+    return (lua_Number)d;
+}
 
-                lua_newtable(L);
-                lua_pushvalue(L, -2); /* callback */
-                lua_rawseti(L, -2, 1);
+static size_t buf_mark(lua_State *L, mar_Buffer *buf)
+{
+    size_t mark = buf->head;
+    uint32_t zero = 0;
+    buf_write(L, (void*)&zero, MAR_I32, buf);
+    return mark;
+}
 
-                buf_init(L, &rec_buf);
-                mar_encode_table(L, &rec_buf, idx);
+static void buf_patch_u32(lua_State *L, mar_Buffer *buf, size_t mark, size_t n)
+{
+    uint32_t n32 = (uint32_t)n;
+    if (n > UINT32_MAX) luaL_error(L, "buffer too long");
+    mar_put32(&buf->data[mark], n32);
+}
 
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_buf.head, MAR_I32, buf);
-                buf_write(L, rec_buf.data, rec_buf.head, buf);
-                buf_done(L, &rec_buf);
-                lua_pop(L, 1);
-            }
-            else {
-                tag = MAR_TVAL;
+static void buf_write_var(lua_State *L, uint64_t v, mar_Buffer *buf)
+{
+    char tmp[10];
+    size_t n = 0;
+    while (v >= 0x80) {
+        tmp[n++] = (char)((v & 0x7f) | 0x80);
+        v >>= 7;
+    }
+    tmp[n++] = (char)v;
+    buf_write(L, tmp, n, buf);
+}
 
-                lua_pushvalue(L, -1);
-                lua_pushinteger(L, (*idx)++);
-                lua_rawset(L, SEEN_IDX);
+/* Lengths, counts and refs are fixed MAR_I32 fields, or varints in compact
+ * mode. Fields that are only known after their payload is written reserve
+ * MAR_VAR32 bytes in compact mode and are patched with a padded varint, so a
+ * body never has to be moved once it is written. */
+static void mar_write_size(lua_State *L, mar_Ctx *ctx, mar_Buffer *buf, size_t n)
+{
+    if (ctx->flags & MAR_FCOMPACT) {
+        buf_write_var(L, n, buf);
+    }
+    else {
+        char b[MAR_I32];
+        if (n > UINT32_MAX) luaL_error(L, "buffer too long");
+        mar_put32(b, (uint32_t)n);
+        buf_write(L, b, MAR_I32, buf);
+    }
+}
 
-                lua_pushvalue(L, -1);
-                buf_init(L, &rec_buf);
-                mar_encode_table(L, &rec_buf, idx);
-                lua_pop(L, 1);
+static size_t mar_mark(lua_State *L, mar_Ctx *ctx, mar_Buffer *buf)
+{
+    if (ctx->flags & MAR_FSTREAM) {
+        return 0; /* streamed bodies are not length prefixed */
+    }
+    if (ctx->flags & MAR_FCOMPACT) {
+        size_t mark = buf->head;
+        char zero[MAR_VAR32] = { 0 };
+        buf_write(L, zero, MAR_VAR32, buf);
+        return mark;
+    }
+    return buf_mark(L, buf);
+}
 
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_buf.head, MAR_I32, buf);
-                buf_write(L, rec_buf.data,rec_buf.head, buf);
-                buf_done(L, &rec_buf);
-            }
-        }
-        break;
+static void mar_patch_size(lua_State *L, mar_Ctx *ctx, mar_Buffer *buf, size_t mark, size_t n)
+{
+    if (ctx->flags & MAR_FSTREAM) {
+        return;
     }
-    case LUA_TFUNCTION: {
-        int tag, ref;
-        lua_pushvalue(L, -1);
-        lua_rawget(L, SEEN_IDX);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
+    if (ctx->flags & MAR_FCOMPACT) {
+        char *p = &buf->data[mark];
+        size_t i;
+        if (n > UINT32_MAX) luaL_error(L, "buffer too long");
+        for (i = 0; i < MAR_VAR32 - 1; i++, n >>= 7) {
+            p[i] = (char)((n & 0x7f) | 0x80);
         }
-        else {
-            mar_Buffer rec_buf;
-            int i;
-            lua_Debug ar;
-            lua_pop(L, 1); /* pop nil */
+        p[i] = (char)n;
+    }
+    else {
+        buf_patch_u32(L, buf, mark, n);
+    }
+}
 
-            lua_pushvalue(L, -1);
-            lua_getinfo(L, ">nuS", &ar);
-            if (ar.what[0] != 'L') {
-                luaL_error(L, "attempt to persist a C function '%s'", ar.name);
-            }
-            tag = MAR_TVAL;
-            lua_pushvalue(L, -1);
-            lua_pushinteger(L, (*idx)++);
-            lua_rawset(L, SEEN_IDX);
+static void mar_patch(lua_State *L, mar_Ctx *ctx, mar_Buffer *buf, size_t mark)
+{
+    size_t width = (ctx->flags & MAR_FCOMPACT) ? MAR_VAR32 : MAR_I32;
+    mar_patch_size(L, ctx, buf, mark, buf->head - mark - width);
+}
 
-            lua_pushvalue(L, -1);
-            buf_init(L, &rec_buf);
-            lua_dump(L, (lua_Writer)buf_write, &rec_buf);
+#if LUA_VERSION_NUM < 503
+/* true if n survives a round trip through int64_t (and is not -0) */
+static int mar_num_int(lua_Number n, int64_t *i)
+{
+    lua_Number zero = 0;
+    if (!(n >= -9223372036854775808.0 && n < 9223372036854775808.0)) return 0;
+    *i = (int64_t)n;
+    if ((lua_Number)*i != n) return 0;
+    return *i != 0 || memcmp(&n, &zero, sizeof(n)) == 0;
+}
+#endif
 
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&rec_buf.head, MAR_I32, buf);
-            buf_write(L, rec_buf.data, rec_buf.head, buf);
-            buf_done(L, &rec_buf);
-            lua_pop(L, 1);
+/* True if the number at idx is written as a MAR_TINT: an integer from Lua
+ * 5.3 on, where floats keep their type and are written in full, or any
+ * integral number in compact mode before that. */
+static int mar_isint(lua_State *L, int idx, mar_Ctx *ctx, int64_t *i)
+{
+#if LUA_VERSION_NUM >= 503
+    if (!lua_isinteger(L, idx)) return 0;
+    *i = (int64_t)lua_tointeger(L, idx);
+    return 1;
+#else
+    return (ctx->flags & MAR_FCOMPACT) && mar_num_int(lua_tonumber(L, idx), i);
+#endif
+}
 
-            lua_newtable(L);
-            for (i=1; i <= ar.nups; i++) {
-                lua_getupvalue(L, -2, i);
-                lua_rawseti(L, -2, i);
-            }
+static size_t mar_var_size(uint64_t v)
+{
+    size_t n = 1;
+    for (; v >= 0x80; v >>= 7) n++;
+    return n;
+}
 
-            buf_init(L, &rec_buf);
-            mar_encode_table(L, &rec_buf, idx);
+#define mar_zigzag(i) ((i) < 0 ? (((uint64_t)-((i) + 1)) << 1) | 1 : ((uint64_t)(i)) << 1)
+#define mar_unzigzag(zz) (((zz) & 1) ? -(int64_t)((zz) >> 1) - 1 : (int64_t)((zz) >> 1))
 
-            buf_write(L, (void*)&rec_buf.head, MAR_I32, buf);
-            buf_write(L, rec_buf.data, rec_buf.head, buf);
-            buf_done(L, &rec_buf);
-            lua_pop(L, 1);
+/* A table whose keys are exactly 1..n, with n at least MAR_PACK_MIN, and
+ * whose values are all floats, all integers (as mar_isint has it) or all
+ * strings is written packed:
+ *
+ *   [size][kind][n][payload]
+ *
+ * size counts the bytes after it. Floats are 8 bytes each, integers zigzag
+ * varints and strings a varint length and their bytes. Returns the kind,
+ * or 0 if the table at t doesn't qualify, and the size. */
+static int mar_pack_kind(lua_State *L, int t, mar_Ctx *ctx, size_t *size)
+{
+    size_t len = lua_objlen(L, t), count = 0, bytes = 0, l;
+    int kind = 0, k;
+    int64_t i;
+    if (len < MAR_PACK_MIN) return 0;
+    lua_pushnil(L);
+    while (lua_next(L, t) != 0) {
+        lua_Number key;
+        if (lua_type(L, -2) != LUA_TNUMBER) {
+            lua_pop(L, 2);
+            return 0;
         }
-
-        break;
-    }
-    case LUA_TUSERDATA: {
-        int tag, ref;
-        lua_pushvalue(L, -1);
-        lua_rawget(L, SEEN_IDX);
-        if (!lua_isnil(L, -1)) {
-            ref = lua_tointeger(L, -1);
-            tag = MAR_TREF;
-            buf_write(L, (void*)&tag, MAR_CHR, buf);
-            buf_write(L, (void*)&ref, MAR_I32, buf);
-            lua_pop(L, 1);
+        key = lua_tonumber(L, -2);
+        if (!(key >= 1 && key <= (lua_Number)len) || (lua_Number)(size_t)key != key) {
+            lua_pop(L, 2);
+            return 0;
         }
-        else {
-            mar_Buffer rec_buf;
-            lua_pop(L, 1); /* pop nil */
-            if (luaL_getmetafield(L, -1, "__persist")) {
-                tag = MAR_TUSR;
-
-                lua_pushvalue(L, -2);
-                lua_pushinteger(L, (*idx)++);
-                lua_rawset(L, SEEN_IDX);
-
-                lua_pushvalue(L, -2);
-                lua_call(L, 1, 1);
-                if (!lua_isfunction(L, -1)) {
-                    luaL_error(L, "__persist must return a function");
-                }
-                lua_newtable(L);
-                lua_pushvalue(L, -2);
-                lua_rawseti(L, -2, 1);
-                lua_remove(L, -2);
-
-                buf_init(L, &rec_buf);
-                mar_encode_table(L, &rec_buf, idx);
-
-                buf_write(L, (void*)&tag, MAR_CHR, buf);
-                buf_write(L, (void*)&rec_buf.head, MAR_I32, buf);
-		buf_write(L, rec_buf.data, rec_buf.head, buf);
-		buf_done(L, &rec_buf);
+        switch (lua_type(L, -1)) {
+        case LUA_TSTRING:
+            k = MAR_PSTR;
+            l = lua_objlen(L, -1);
+            bytes += mar_var_size(l) + l;
+            break;
+        case LUA_TNUMBER:
+            if (mar_isint(L, -1, ctx, &i)) {
+                k = MAR_PINT;
+                bytes += mar_var_size(mar_zigzag(i));
             }
             else {
-                luaL_error(L, "attempt to encode userdata (no __persist hook)");
+                k = MAR_PNUM;
+                bytes += MAR_I64;
             }
-            lua_pop(L, 1);
+            break;
+        default:
+            k = 0;
         }
-        break;
-    }
-    case LUA_TNIL: break;
-    default:
-        luaL_error(L, "invalid value type (%s)", lua_typename(L, val_type));
+        if (k == 0 || (kind && k != kind)) {
+            lua_pop(L, 2);
+            return 0;
+        }
+        kind = k;
+        count++;
+        lua_pop(L, 1);
     }
-    lua_pop(L, 1);
+    if (count != len) return 0;
+    /* interned strings are worth more than packing them */
+    if (kind == MAR_PSTR && ctx->strmin) return 0;
+    bytes += MAR_CHR + ((ctx->flags & MAR_FCOMPACT) ? mar_var_size(len) : MAR_I32);
+    if (bytes > UINT32_MAX) return 0;
+    *size = bytes;
+    return kind;
 }
 
-static int mar_encode_table(lua_State *L, mar_Buffer *buf, size_t *idx)
+/* writes the table at t packed, after its type byte, or returns 0 */
+static int mar_encode_packed(lua_State *L, mar_Buffer *buf, int t, mar_Ctx *ctx)
 {
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0) {
-        mar_encode_value(L, buf, -2, idx);
-        mar_encode_value(L, buf, -1, idx);
+    size_t n = lua_objlen(L, t), size, i, l;
+    int kind = mar_pack_kind(L, t, ctx, &size);
+    char chunk[MAR_PACK_CHUNK];
+    size_t fill = 0;
+    int64_t v = 0;
+    if (!kind) return 0;
+
+    chunk[0] = MAR_TPKD;
+    buf_write(L, chunk, MAR_CHR, buf);
+    mar_write_size(L, ctx, buf, size);
+    chunk[0] = (char)kind;
+    buf_write(L, chunk, MAR_CHR, buf);
+    mar_write_size(L, ctx, buf, n);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, t, (int)i);
+        switch (kind) {
+        case MAR_PNUM:
+            mar_put_num(chunk + fill, lua_tonumber(L, -1));
+            fill += MAR_I64;
+            break;
+        case MAR_PINT: {
+            uint64_t zz;
+            mar_isint(L, -1, ctx, &v);
+            for (zz = mar_zigzag(v); zz >= 0x80; zz >>= 7) {
+                chunk[fill++] = (char)((zz & 0x7f) | 0x80);
+            }
+            chunk[fill++] = (char)zz;
+            break;
+        }
+        case MAR_PSTR: {
+            const char *s = lua_tolstring(L, -1, &l);
+            buf_write(L, chunk, fill, buf);
+            fill = 0;
+            buf_write_var(L, l, buf);
+            buf_write(L, s, l, buf);
+            break;
+        }
+        }
         lua_pop(L, 1);
+        if (fill > MAR_PACK_CHUNK - 10) {
+            buf_write(L, chunk, fill, buf);
+            fill = 0;
+        }
     }
+    buf_write(L, chunk, fill, buf);
     return 1;
 }
 
-#define mar_incr_ptr(l) \
-    if (((*p)-buf)+(l) > len) luaL_error(L, "bad code"); (*p) += (l);
+/* True if the value on top of the stack is the globals table, as the
+ * upvalue name of a function. Functions from Lua 5.2 on reach globals
+ * through an _ENV upvalue, which is left out when encoding and bound to
+ * the globals of the decoding state instead. */
+static int mar_is_env(lua_State *L, const char *name)
+{
+#if LUA_VERSION_NUM >= 502
+    int r;
+    if (!name || strcmp(name, "_ENV") != 0) return 0;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+    r = lua_rawequal(L, -1, -2);
+    lua_pop(L, 1);
+    return r;
+#else
+    (void)L;
+    (void)name;
+    return 0;
+#endif
+}
 
-#define mar_next_len(l,T) \
-    if (((*p)-buf)+sizeof(T) > len) luaL_error(L, "bad code"); \
-    l = *(T*)*p; (*p) += sizeof(T);
+static const char* buf_read(lua_State *L, mar_Buffer *buf, size_t *len)
+{
+    if (buf->seek < buf->head) {
+        buf->seek = buf->head;
+        *len = buf->seek;
+        return buf->data;
+    }
+    *len = 0;
+    return NULL;
+}
 
-static void mar_decode_value
-    (lua_State *L, const char *buf, size_t len, const char **p, size_t *idx)
+/* Block compression
+ *
+ * With the compress option everything after the header is cut into blocks
+ * of at most MAR_BLOCK_SIZE bytes, each written as
+ *
+ *   [raw length][compressed length][data]
+ *
+ * with varint lengths, and ended by a block of raw length 0. A compressed
+ * length of 0 means the block is stored as it is. The data uses the LZ4
+ * block format: a token byte holding the literal count (high nibble) and
+ * the match length less 4 (low nibble), either extended by bytes of 255,
+ * the literals, then the match offset as two little endian bytes. */
+static uint32_t lz_read32(const unsigned char *p)
 {
-    size_t l;
-    char val_type = **p;
-    mar_incr_ptr(MAR_CHR);
-    switch (val_type) {
-    case LUA_TBOOLEAN:
-        lua_pushboolean(L, *(char*)*p);
-        mar_incr_ptr(MAR_CHR);
-        break;
-    case LUA_TNUMBER:
-        lua_pushnumber(L, *(lua_Number*)*p);
-        mar_incr_ptr(MAR_I64);
-        break;
-    case LUA_TSTRING:
-        mar_next_len(l, uint32_t);
-        lua_pushlstring(L, *p, l);
-        mar_incr_ptr(l);
-        break;
-    case LUA_TTABLE: {
-        char tag = *(char*)*p;
-        mar_incr_ptr(MAR_CHR);
-        if (tag == MAR_TREF) {
-            int ref;
-            mar_next_len(ref, int);
-            lua_rawgeti(L, SEEN_IDX, ref);
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned char *lz_write_len(unsigned char *op, size_t n)
+{
+    for (; n >= 255; n -= 255) *op++ = 255;
+    *op++ = (unsigned char)n;
+    return op;
+}
+
+static size_t lz_compress(const unsigned char *src, size_t n, unsigned char *dst)
+{
+    uint32_t table[MAR_LZ_HSIZE];
+    const unsigned char *ip = src, *anchor = src, *end = src + n;
+    unsigned char *op = dst;
+    size_t lit;
+
+    memset(table, 0, sizeof(table));
+    if (n > MAR_LZ_LIMIT) {
+        const unsigned char *ilimit = end - MAR_LZ_LIMIT, *mlimit = end - 5;
+        while (ip < ilimit) {
+            uint32_t seq = lz_read32(ip);
+            uint32_t h = (seq * 2654435761u) >> (32 - MAR_LZ_HBITS);
+            const unsigned char *ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref < ip && ip - ref <= 0xffff && lz_read32(ref) == seq) {
+                const unsigned char *m = ip + 4;
+                size_t mlen, off = ip - ref;
+                while (m < mlimit && *m == ref[m - ip]) m++;
+                lit = ip - anchor;
+                mlen = m - ip - 4;
+                *op++ = (unsigned char)(((lit < 15 ? lit : 15) << 4) | (mlen < 15 ? mlen : 15));
+                if (lit >= 15) op = lz_write_len(op, lit - 15);
+                memcpy(op, anchor, lit);
+                op += lit;
+                *op++ = (unsigned char)(off & 0xff);
+                *op++ = (unsigned char)(off >> 8);
+                if (mlen >= 15) op = lz_write_len(op, mlen - 15);
+                ip = anchor = m;
+            }
+            else {
+                ip++;
+            }
         }
-        else if (tag == MAR_TVAL) {
-            mar_next_len(l, uint32_t);
-            lua_newtable(L);
-            lua_pushvalue(L, -1);
-            lua_rawseti(L, SEEN_IDX, (*idx)++);
-            mar_decode_table(L, *p, l, idx);
-            mar_incr_ptr(l);
+    }
+    lit = end - anchor;
+    *op++ = (unsigned char)((lit < 15 ? lit : 15) << 4);
+    if (lit >= 15) op = lz_write_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/* false unless src holds exactly n bytes worth of sequences */
+static int lz_decompress(const unsigned char *src, size_t l, unsigned char *dst, size_t n)
+{
+    const unsigned char *ip = src, *iend = src + l;
+    unsigned char *op = dst, *oend = dst + n;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t len = token >> 4, off;
+        unsigned c;
+        if (len == 15) {
+            do {
+                if (ip == iend) return 0;
+                c = *ip++;
+                len += c;
+            } while (c == 255);
         }
-        else if (tag == MAR_TUSR) {
-            mar_next_len(l, uint32_t);
-            lua_newtable(L);
-            mar_decode_table(L, *p, l, idx);
-            lua_rawgeti(L, -1, 1);
-            lua_call(L, 0, 1);
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return 0;
+        memcpy(op, ip, len);
+        ip += len;
+        op += len;
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return 0;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return 0;
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip == iend) return 0;
+                c = *ip++;
+                len += c;
+            } while (c == 255);
+        }
+        len += 4;
+        if (len > (size_t)(oend - op)) return 0;
+        for (; len > 0; len--, op++) *op = op[-(ptrdiff_t)off];
+    }
+    return op == oend;
+}
+
+/* most bytes lz_compress writes for n bytes of input */
+#define lz_bound(n) ((n) + (n) / 255 + 16)
+
+#ifdef MAR_THREADS
+/* appends n bytes at src to buf as one block, or stores it if it doesn't
+ * shrink, given its compressed length l in out */
+static void lz_store
+    (lua_State *L, mar_Buffer *buf, const char *src, size_t n, const char *out, size_t l)
+{
+    buf_write_var(L, n, buf);
+    if (l >= n) {
+        buf_write_var(L, 0, buf);
+        buf_write(L, src, n, buf);
+    }
+    else {
+        buf_write_var(L, l, buf);
+        buf_write(L, out, l, buf);
+    }
+}
+
+/* blocks [first, last) of the input, compressed into out at lz_bound of a
+ * block apart */
+typedef struct mar_LzJob {
+    const char *src;
+    size_t len;
+    char *out;
+    size_t *lens;
+    size_t first;
+    size_t last;
+} mar_LzJob;
+
+static void lz_job(mar_LzJob *job)
+{
+    size_t i, bound = lz_bound(MAR_BLOCK_SIZE);
+    for (i = job->first; i < job->last; i++) {
+        size_t pos = i * MAR_BLOCK_SIZE;
+        size_t n = job->len - pos < MAR_BLOCK_SIZE ? job->len - pos : MAR_BLOCK_SIZE;
+        job->lens[i] = lz_compress((const unsigned char*)job->src + pos, n,
+            (unsigned char*)job->out + i * bound);
+    }
+}
+
+static void *lz_worker(void *ud)
+{
+    lz_job((mar_LzJob*)ud);
+    return NULL;
+}
+
+/* Compresses the blocks after the header of src on up to threads threads,
+ * this one included, then appends them to dst in order, so the output is
+ * the same as from one thread. The other threads only run lz_compress and
+ * never touch the Lua state; nothing can raise an error while they run.
+ * Returns the input offset it got to. */
+static size_t lz_parallel(lua_State *L, mar_Buffer *src, mar_Buffer *dst, int threads)
+{
+    const char *data = src->data + MAR_HEAD_SIZE;
+    size_t len = src->head - MAR_HEAD_SIZE, bound = lz_bound(MAR_BLOCK_SIZE);
+    size_t nblocks = (len + MAR_BLOCK_SIZE - 1) / MAR_BLOCK_SIZE, i;
+    mar_LzJob jobs[MAR_THREADS_MAX];
+    pthread_t tids[MAR_THREADS_MAX];
+    int started[MAR_THREADS_MAX];
+    size_t *lens;
+    char *out;
+    int t;
+
+    if (threads > MAR_THREADS_MAX) threads = MAR_THREADS_MAX;
+    if ((size_t)threads > nblocks) threads = (int)nblocks;
+    if (nblocks > (size_t)-1 / (bound + sizeof(size_t))) luaL_error(L, "Out of memory!");
+    lens = (size_t*)lua_newuserdata(L, nblocks * (sizeof(size_t) + bound));
+    out = (char*)(lens + nblocks);
+
+    for (t = 0; t < threads; t++) {
+        jobs[t].src = data;
+        jobs[t].len = len;
+        jobs[t].out = out;
+        jobs[t].lens = lens;
+        jobs[t].first = nblocks * t / threads;
+        jobs[t].last = nblocks * (t + 1) / threads;
+    }
+    for (t = 1; t < threads; t++) {
+        started[t] = pthread_create(&tids[t], NULL, lz_worker, &jobs[t]) == 0;
+    }
+    lz_job(&jobs[0]);
+    for (t = 1; t < threads; t++) {
+        if (started[t]) pthread_join(tids[t], NULL);
+        else lz_job(&jobs[t]); /* no thread for it, do it here */
+    }
+
+    for (i = 0; i < nblocks; i++) {
+        size_t pos = i * MAR_BLOCK_SIZE;
+        size_t n = len - pos < MAR_BLOCK_SIZE ? len - pos : MAR_BLOCK_SIZE;
+        lz_store(L, dst, data + pos, n, out + i * bound, lens[i]);
+    }
+    lua_pop(L, 1);
+    return src->head;
+}
+#endif
+
+/* appends n bytes at src to buf as one block */
+static void lz_block(lua_State *L, mar_Buffer *buf, const char *src, size_t n)
+{
+    size_t l, at;
+    buf_reserve(L, buf, buf->head + 2 * MAR_LZ_HEAD + lz_bound(n));
+    at = buf->head + 2 * MAR_LZ_HEAD;
+    l = lz_compress((const unsigned char*)src, n, (unsigned char*)buf->data + at);
+    buf_write_var(L, n, buf);
+    if (l >= n) {
+        buf_write_var(L, 0, buf);
+        buf_write(L, src, n, buf);
+    }
+    else {
+        buf_write_var(L, l, buf);
+        memmove(buf->data + buf->head, buf->data + at, l);
+        buf->head += l;
+    }
+}
+
+/* compresses the encoded value in src into dst, keeping the header */
+static void lz_buffer(lua_State *L, mar_Buffer *src, mar_Buffer *dst, int threads)
+{
+    size_t pos = MAR_HEAD_SIZE, n;
+    dst->head = 0;
+    dst->seek = 0;
+    buf_write(L, src->data, MAR_HEAD_SIZE, dst);
+#ifdef MAR_THREADS
+    if (threads > 1 && src->head - MAR_HEAD_SIZE > MAR_BLOCK_SIZE) {
+        pos = lz_parallel(L, src, dst, threads);
+    }
+#endif
+    for (; pos < src->head; pos += n) {
+        n = src->head - pos < MAR_BLOCK_SIZE ? src->head - pos : MAR_BLOCK_SIZE;
+        lz_block(L, dst, src->data + pos, n);
+    }
+    buf_write_var(L, 0, dst);
+}
+
+/* Sink used by encode_to to compress each chunk on its way to the real
+ * one. The header goes through as it is. */
+typedef struct mar_LzSink {
+    mar_Sink sink;
+    void*  ud;
+    int    head;    /* header bytes still to pass through */
+    mar_Buffer *out;
+} mar_LzSink;
+
+static void lz_sink_write(lua_State *L, void *ud, const char *data, size_t len)
+{
+    mar_LzSink *z = (mar_LzSink*)ud;
+    if (z->head) {
+        size_t n = len < (size_t)z->head ? len : (size_t)z->head;
+        z->sink(L, z->ud, data, n);
+        z->head -= (int)n;
+        data += n;
+        len -= n;
+    }
+    while (len > 0) {
+        size_t n = len < MAR_BLOCK_SIZE ? len : MAR_BLOCK_SIZE;
+        z->out->head = 0;
+        lz_block(L, z->out, data, n);
+        z->sink(L, z->ud, z->out->data, z->out->head);
+        data += n;
+        len -= n;
+    }
+}
+
+/* Function prototypes are kept in a table hung off the seen table. When
+ * encoding it maps dumped bytecode to its prototype number, when decoding
+ * it maps each prototype number back to the bytecode. */
+static void mar_push_aux(lua_State *L, void *key)
+{
+    lua_pushlightuserdata(L, key);
+    lua_rawget(L, SEEN_IDX);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushlightuserdata(L, key);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, SEEN_IDX);
+    }
+}
+
+static void mar_push_protos(lua_State *L)
+{
+    mar_push_aux(L, (void*)&mar_protos_key);
+}
+
+/* Shapes are numbered in the order they are first written. The decoder
+ * keeps the keys of each one, in order, in a table hung off the seen
+ * table. */
+static void mar_push_shapes(lua_State *L)
+{
+    mar_push_aux(L, (void*)&mar_shapes_key);
+}
+
+static mar_Encoder *mar_push_encoder(lua_State *L, mar_Ctx *opts)
+{
+    mar_Encoder *enc = (mar_Encoder*)lua_newuserdata(L, sizeof(mar_Encoder));
+    enc->buf.data = NULL;
+    enc->code.data = NULL;
+    enc->objs.count = 0;
+    enc->objs.mask = 0;
+    enc->objs.slots = NULL;
+    enc->objs.arena = opts->arena;
+    enc->dirty = 0;
+    enc->opts = *opts;
+    luaL_getmetatable(L, MAR_ENCODER);
+    lua_setmetatable(L, -2);
+    lua_newtable(L); /* seen table, reused across calls */
+    lua_setfenv(L, -2);
+    buf_init(L, &enc->buf, opts->arena);
+    buf_init(L, &enc->code, opts->arena);
+    return enc;
+}
+
+static size_t seen_hash(const void *p)
+{
+    uintptr_t h = (uintptr_t)p;
+    h ^= h >> 16;
+    h *= 0x45d9f3bUL;
+    h ^= h >> 16;
+    return (size_t)h;
+}
+
+/* like buf_done, leaves memory of an arena alone */
+static void seen_free(lua_State *L, mar_Seen *s)
+{
+    if (s->slots && !s->arena) {
+        mar_lalloc(L, s->slots, (s->mask + 1) * sizeof(mar_Slot), 0);
+    }
+}
+
+/* seen index of the object at p, or 0 */
+static size_t seen_get(mar_Seen *s, const void *p)
+{
+    size_t i;
+    if (!s->slots) return 0;
+    for (i = seen_hash(p) & s->mask; s->slots[i].idx; i = (i + 1) & s->mask) {
+        if (s->slots[i].p == p) return s->slots[i].idx;
+    }
+    return 0;
+}
+
+static void seen_put(lua_State *L, mar_Seen *s, const void *p, size_t idx)
+{
+    size_t i;
+    if (2 * (s->count + 1) > s->mask + 1 || !s->slots) {
+        size_t n = s->slots ? 2 * (s->mask + 1) : 64, j;
+        mar_Slot *slots;
+        if (n > (size_t)-1 / sizeof(mar_Slot)) luaL_error(L, "Out of memory!");
+        slots = (mar_Slot*)mar_realloc(L, s->arena, NULL, 0, n * sizeof(mar_Slot));
+        memset(slots, 0, n * sizeof(mar_Slot));
+        for (j = 0; s->slots && j <= s->mask; j++) {
+            if (!s->slots[j].idx) continue;
+            for (i = seen_hash(s->slots[j].p) & (n - 1); slots[i].idx; i = (i + 1) & (n - 1));
+            slots[i] = s->slots[j];
+        }
+        seen_free(L, s);
+        s->slots = slots;
+        s->mask = n - 1;
+    }
+    for (i = seen_hash(p) & s->mask; s->slots[i].idx; i = (i + 1) & s->mask) {
+        if (s->slots[i].p == p) {
+            s->slots[i].idx = idx;
+            return;
+        }
+    }
+    s->slots[i].p = p;
+    s->slots[i].idx = idx;
+    s->count++;
+}
+
+/* seen index of the object at p in this encode or its constants, or 0 */
+static size_t mar_ref(mar_Ctx *ctx, const void *p)
+{
+    size_t ref = seen_get(ctx->objs, p);
+    if (!ref && ctx->consts) ref = seen_get(ctx->consts, p);
+    return ref;
+}
+
+/* the C hook in the __marshal field of the metatable of the value at idx,
+ * or of the metatable itself if it is a table, or NULL */
+static const mar_Hook *mar_hook(lua_State *L, int idx)
+{
+    const mar_Hook *hook = NULL;
+    if (lua_istable(L, idx)) {
+        lua_pushliteral(L, "__marshal");
+        lua_rawget(L, idx < 0 ? idx - 1 : idx);
+    }
+    else if (!luaL_getmetafield(L, idx, "__marshal")) {
+        return NULL;
+    }
+    if (lua_islightuserdata(L, -1)) hook = (const mar_Hook*)lua_touserdata(L, -1);
+    lua_pop(L, 1);
+    return hook;
+}
+
+/* empties the set, giving back the memory if it grew large */
+static void seen_clear(lua_State *L, mar_Seen *s)
+{
+    if (s->slots && s->mask >= 4096) {
+        seen_free(L, s);
+        s->slots = NULL;
+        s->mask = 0;
+    }
+    else if (s->count) {
+        memset(s->slots, 0, (s->mask + 1) * sizeof(mar_Slot));
+    }
+    s->count = 0;
+}
+
+/* Dump buffer for closures and the seen set. Unless the caller provides
+ * them, they are owned by an encoder kept in the seen table, so that they
+ * are freed even when encoding fails part way. */
+static mar_Encoder *mar_own(lua_State *L, mar_Ctx *ctx)
+{
+    mar_Encoder *enc;
+    lua_pushlightuserdata(L, (void*)&mar_scratch_key);
+    enc = mar_push_encoder(L, ctx);
+    lua_rawset(L, SEEN_IDX);
+    if (!ctx->scratch) ctx->scratch = &enc->code;
+    if (!ctx->objs) ctx->objs = &enc->objs;
+    return enc;
+}
+
+static mar_Buffer *mar_scratch(lua_State *L, mar_Ctx *ctx)
+{
+    if (!ctx->scratch) mar_own(L, ctx);
+    ctx->scratch->head = 0;
+    ctx->scratch->seek = 0;
+    return ctx->scratch;
+}
+
+static void mar_encode_ref(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, size_t ref)
+{
+    char tag = MAR_TREF;
+    mar_stat(mar_stats.refs++);
+    buf_write(L, &tag, MAR_CHR, buf);
+    mar_write_size(L, ctx, buf, ref);
+}
+
+/* The index written after a value encoded with the index option is a hash
+ * table of the root table's string and number keys:
+ *
+ *   [nslots][slot * nslots][entry...][offset of nslots]
+ *
+ * all fixed MAR_I32 fields. A slot holds the offset of an entry from the
+ * start of the index, or 0 when empty. An entry is the key's hash, its type
+ * byte and its bytes (a lua_Number, an integer from Lua 5.3 on, or a
+ * MAR_I32 length and the string),
+ * then where its value starts, relative to the first entry of the root
+ * table, and the seen index, prototype count and shape count there. */
+static uint32_t mar_hash(int type, const char *p, size_t l)
+{
+    uint32_t h = 2166136261u;
+    size_t i;
+    h = (h ^ (unsigned char)type) * 16777619u;
+    for (i = 0; i < l; i++) {
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    }
+    return h;
+}
+
+/* the type and bytes of an index key, or 0 for keys that aren't indexed */
+static int mar_index_key(lua_State *L, int key, char *num, const char **p, size_t *l)
+{
+    switch (lua_type(L, key)) {
+    case LUA_TNUMBER: {
+        lua_Number n;
+#if LUA_VERSION_NUM >= 503
+        /* compared exactly, floats with an integral value included, as
+         * they are the same key in a table */
+        int isint;
+        lua_Integer i = lua_tointegerx(L, key, &isint);
+        if (isint) {
+            mar_put64(num, (uint64_t)i);
+            *p = num;
+            *l = MAR_I64;
+            return MAR_TINT;
+        }
+#endif
+        n = lua_tonumber(L, key);
+        if (n == 0) n = 0; /* -0 is the same key */
+        mar_put_num(num, n);
+        *p = num;
+        *l = MAR_I64;
+        return LUA_TNUMBER;
+    }
+    case LUA_TSTRING:
+        *p = lua_tolstring(L, key, l);
+        return LUA_TSTRING;
+    }
+    return 0;
+}
+
+static void buf_write_u32(lua_State *L, size_t n, mar_Buffer *buf)
+{
+    char b[MAR_I32];
+    if (n > 0xffffffffUL) luaL_error(L, "value too large to index");
+    mar_put32(b, (uint32_t)n);
+    buf_write(L, b, MAR_I32, buf);
+}
+
+static void mar_index_add(lua_State *L, mar_Buffer *index, int key, size_t off, mar_Ctx *ctx)
+{
+    char n[MAR_I64];
+    const char *p;
+    size_t l;
+    char type = (char)mar_index_key(L, key, n, &p, &l);
+    if (!type) return;
+    buf_write_u32(L, mar_hash(type, p, l), index);
+    buf_write(L, &type, MAR_CHR, index);
+    if (type == LUA_TSTRING) buf_write_u32(L, l, index);
+    buf_write(L, p, l, index);
+    buf_write_u32(L, off, index);
+    buf_write_u32(L, ctx->idx, index);
+    buf_write_u32(L, ctx->nprotos, index);
+    buf_write_u32(L, ctx->nshapes, index);
+}
+
+static size_t mar_index_entry(const char *entry)
+{
+    size_t l = MAR_I64;
+    if (entry[MAR_I32] == LUA_TSTRING) {
+        l = MAR_I32 + mar_get32(entry + MAR_I32 + MAR_CHR);
+    }
+    return MAR_I32 + MAR_CHR + l + 4 * MAR_I32;
+}
+
+/* writes the index from the entries collected in ienc->buf */
+static void mar_write_index(lua_State *L, mar_Buffer *buf, mar_Encoder *ienc)
+{
+    mar_Buffer *entries = &ienc->buf;
+    uint32_t *slots;
+    size_t foot = buf->head, count = 0, nslots = 0, pos;
+
+    for (pos = 0; pos < entries->head; pos += mar_index_entry(entries->data + pos)) {
+        count++;
+    }
+    if (count > 0) {
+        for (nslots = 1; nslots < 2 * count; nslots *= 2);
+    }
+    buf_reserve(L, &ienc->code, nslots * MAR_I32 + 1);
+    slots = (uint32_t*)ienc->code.data;
+    memset(slots, 0, nslots * MAR_I32);
+    for (pos = 0; pos < entries->head; pos += mar_index_entry(entries->data + pos)) {
+        uint32_t h = mar_get32(entries->data + pos);
+        size_t i;
+        for (i = h & (nslots - 1); slots[i]; i = (i + 1) & (nslots - 1));
+        if (MAR_I32 * (1 + nslots) + pos > 0xffffffffUL) {
+            luaL_error(L, "value too large to index");
+        }
+        slots[i] = (uint32_t)(MAR_I32 * (1 + nslots) + pos);
+    }
+    for (pos = 0; pos < nslots; pos++) {
+        mar_put32((char*)&slots[pos], slots[pos]);
+    }
+
+    buf_write_u32(L, nslots, buf);
+    buf_write(L, (void*)slots, nslots * MAR_I32, buf);
+    buf_write(L, entries->data, entries->head, buf);
+    buf_write_u32(L, foot, buf);
+}
+
+/* offset of the index at the end of l bytes at s */
+static size_t mar_index_foot(lua_State *L, const char *s, size_t l)
+{
+    uint32_t foot;
+    if (l < 2 * MAR_I32) luaL_error(L, "bad code");
+    foot = mar_get32(s + l - MAR_I32);
+    if (foot > l - 2 * MAR_I32) luaL_error(L, "bad code");
+    return foot;
+}
+
+/* counts the array run 1..narr of the table at idx and the other entries */
+static void mar_count(lua_State *L, int idx, size_t *narr, size_t *nrec)
+{
+    size_t n = 0, r = 0;
+    for (;;) {
+        lua_rawgeti(L, idx, (int)n + 1);
+        if (lua_isnil(L, -1)) break;
+        lua_pop(L, 1);
+        n++;
+    }
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            lua_Number k = lua_tonumber(L, -1);
+            if (k >= 1 && k <= (lua_Number)n && (lua_Number)(size_t)k == k) continue;
+        }
+        r++;
+    }
+    *narr = n;
+    *nrec = r;
+}
+
+/* Opens the body of the value being written as a new frame on the work
+ * stack, taking the table to iterate from the top of the stack, and for a
+ * shape the table of its keys from below it. mark is where the size of the
+ * whole value goes once the body is done. */
+static void mar_encode_open
+    (lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, mar_Stack *st, int kind, size_t mark)
+{
+    mar_Body *body;
+    int i;
+    if (st->depth == st->nbodies) {
+        mar_Body *bodies;
+        if (st->nbodies > ((size_t)-1 / 2) / sizeof(mar_Body)) {
+            luaL_error(L, "nesting too deep");
+        }
+        bodies = (mar_Body*)lua_newuserdata(L, 2 * st->nbodies * sizeof(mar_Body));
+        memcpy(bodies, st->bodies, st->nbodies * sizeof(mar_Body));
+        lua_rawseti(L, st->w, 0);
+        st->bodies = bodies;
+        st->nbodies *= 2;
+    }
+    for (i = 1; i <= 3; i++) {
+        lua_pushvalue(L, st->w + i);
+        lua_rawseti(L, st->w, 3 * (int)st->depth + i);
+    }
+
+    body = &st->bodies[st->depth++];
+    mar_stat(mar_stats.depth = st->depth > mar_stats.depth ? st->depth : mar_stats.depth);
+    body->kind = kind;
+    body->mark = mark;
+    body->narr = 0;
+    body->nrec = 0;
+    body->i = 1;
+    body->shape = 0;
+    body->index = ctx->index;
+    ctx->index = NULL;
+    lua_replace(L, st->w + 1);
+    lua_pushnil(L);
+    lua_replace(L, st->w + 2);
+    if (kind == MAR_KSHAPE) {
+        lua_replace(L, st->w + 3);
+        body->narr = lua_objlen(L, st->w + 3);
+        body->state = MAR_SSHP;
+    }
+    else {
+        lua_pushnil(L);
+        lua_replace(L, st->w + 3);
+        body->state = MAR_SARR;
+        /* counted up front, so that they are written as they are */
+        if (!(ctx->flags & MAR_FSTREAM)) {
+            mar_count(L, st->w + 1, &body->narr, &body->nrec);
+            mar_write_size(L, ctx, buf, body->narr);
+            mar_write_size(L, ctx, buf, body->nrec);
+        }
+        body->start = buf->head;
+    }
+}
+
+/* Writes the value at val. The body of a table, function or __persist object
+ * isn't written here but opened as a body on the work stack, which
+ * mar_encode_step then fills in. */
+static void mar_encode_item
+    (lua_State *L, mar_Buffer *buf, int val, mar_Ctx *ctx, mar_Stack *st)
+{
+    mar_Buffer *index = ctx->index;
+    size_t l;
+    int64_t int_num = 0;
+    int val_type = lua_type(L, val);
+    char tag;
+#ifdef MAR_STATS
+    int stat_type = val_type;
+    size_t stat_pos = mar_stat_pos(buf);
+    clock_t t0;
+#endif
+    lua_pushvalue(L, val);
+    ctx->index = NULL;
+
+    if (val_type == LUA_TNUMBER && mar_isint(L, -1, ctx, &int_num)) {
+        val_type = MAR_TINT;
+    }
+    else if (val_type == LUA_TSTRING && ctx->strmin
+        && lua_objlen(L, -1) >= ctx->strmin) {
+        lua_pushvalue(L, -1);
+        lua_rawget(L, SEEN_IDX);
+        if (lua_isnil(L, -1) && ctx->consts) {
+            lua_pop(L, 1);
+            lua_getfenv(L, 2);
+            lua_pushvalue(L, -2);
+            lua_rawget(L, -2);
             lua_remove(L, -2);
+        }
+        if (!lua_isnil(L, -1)) {
+            val_type = MAR_TSRF; /* leaves the ref on the stack */
+        }
+        else {
+            lua_pop(L, 1);
             lua_pushvalue(L, -1);
-            lua_rawseti(L, SEEN_IDX, (*idx)++);
-            mar_incr_ptr(l);
+            lua_pushinteger(L, ctx->idx++);
+            lua_rawset(L, SEEN_IDX);
+            val_type = MAR_TSTR;
+        }
+    }
+
+    tag = (char)val_type;
+    buf_write(L, &tag, MAR_CHR, buf);
+    switch (val_type) {
+    case LUA_TBOOLEAN:
+        tag = (char)lua_toboolean(L, -1);
+        buf_write(L, &tag, MAR_CHR, buf);
+        break;
+    case LUA_TSTRING:
+    case MAR_TSTR: {
+        const char *str_val = lua_tolstring(L, -1, &l);
+        mar_write_size(L, ctx, buf, l);
+        buf_write(L, str_val, l, buf);
+        break;
+    }
+    case MAR_TSRF: {
+        mar_stat(mar_stats.strrefs++);
+        mar_write_size(L, ctx, buf, (size_t)lua_tointeger(L, -1));
+        lua_pop(L, 1);
+        break;
+    }
+    case LUA_TNUMBER: {
+        char num[MAR_I64];
+        mar_put_num(num, lua_tonumber(L, -1));
+        buf_write(L, num, MAR_I64, buf);
+        break;
+    }
+    case MAR_TINT:
+        buf_write_var(L, mar_zigzag(int_num), buf);
+        break;
+    case LUA_TTABLE: {
+        size_t ref = mar_ref(ctx, lua_topointer(L, -1));
+        if (ref) {
+            mar_encode_ref(L, buf, ctx, ref);
         }
         else {
-            luaL_error(L, "bad encoded data");
+            size_t mark;
+            if (luaL_getmetafield(L, -1, "__persist")) {
+                tag = MAR_TUSR;
+
+                ref = ctx->idx++;
+                seen_put(L, ctx->objs, lua_topointer(L, -2), ref);
+
+                lua_pushvalue(L, -2); /* self */
+                mar_stat(t0 = clock());
+                lua_call(L, 1, 1);
+                mar_stat(mar_stats.persist_time += clock() - t0);
+                mar_stat(mar_stats.persisted++);
+                if (!lua_isfunction(L, -1)) {
+                    luaL_error(L, "__persist must return a function");
+                }
+                /* the callback may be new, keep it alive while its address
+                 * is in the seen set */
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, SEEN_IDX, (int)ref);
+
+                lua_remove(L, -2); /* __persist */
+
+                lua_newtable(L);
+                lua_pushvalue(L, -2); /* callback */
+                lua_rawseti(L, -2, 1);
+
+                buf_write(L, &tag, MAR_CHR, buf);
+                mark = mar_mark(L, ctx, buf);
+                mar_encode_open(L, buf, ctx, st, MAR_KTABLE, mark);
+            }
+            else {
+                tag = MAR_TVAL;
+                mar_stat(mar_stats.tables++);
+
+                seen_put(L, ctx->objs, lua_topointer(L, -1), ctx->idx++);
+                /* the body of an indexed table has to be walked */
+                if (!index && mar_encode_packed(L, buf, lua_gettop(L), ctx)) break;
+
+                buf_write(L, &tag, MAR_CHR, buf);
+                mark = mar_mark(L, ctx, buf);
+                lua_pushvalue(L, -1);
+                ctx->index = index;
+                mar_encode_open(L, buf, ctx, st, MAR_KTABLE, mark);
+            }
+        }
+        break;
+    }
+    case LUA_TFUNCTION: {
+        size_t ref = mar_ref(ctx, lua_topointer(L, -1));
+        if (ref) {
+            mar_encode_ref(L, buf, ctx, ref);
+        }
+        else {
+            size_t mark;
+            int i;
+            lua_Debug ar;
+            mar_Buffer *code;
+
+            if (ctx->portable) {
+                luaL_error(L, "attempt to encode a function in portable mode");
+            }
+            lua_pushvalue(L, -1);
+            lua_getinfo(L, ">nuS", &ar);
+            if (ar.what[0] != 'L') {
+                luaL_error(L, "attempt to persist a C function '%s'", ar.name);
+            }
+            seen_put(L, ctx->objs, lua_topointer(L, -1), ctx->idx++);
+            mar_stat(mar_stats.functions++);
+
+            code = mar_scratch(L, ctx);
+            lua_pushvalue(L, -1);
+            mar_dump(L, (lua_Writer)buf_write, code);
+            lua_pop(L, 1);
+
+            mar_push_protos(L);
+            lua_pushlstring(L, code->data, code->head);
+            lua_pushvalue(L, -1);
+            lua_rawget(L, -3);
+            if (!lua_isnil(L, -1)) {
+                /* same bytecode as an earlier closure, refer to that */
+                size_t proto = (size_t)lua_tointeger(L, -1);
+                tag = MAR_TPRO;
+                mar_stat(mar_stats.protos++);
+                buf_write(L, &tag, MAR_CHR, buf);
+                mar_write_size(L, ctx, buf, proto);
+                lua_pop(L, 3);
+            }
+            else {
+                lua_pop(L, 1);
+                lua_pushinteger(L, ++ctx->nprotos);
+                lua_rawset(L, -3);
+                lua_pop(L, 1);
+                tag = MAR_TVAL;
+                buf_write(L, &tag, MAR_CHR, buf);
+                mar_write_size(L, ctx, buf, code->head);
+                buf_write(L, code->data, code->head, buf);
+            }
+
+            lua_newtable(L);
+            for (i=1; i <= ar.nups; i++) {
+                if (mar_is_env(L, lua_getupvalue(L, -2, i))) {
+                    lua_pop(L, 1);
+                    continue;
+                }
+                lua_rawseti(L, -2, i);
+            }
+
+            mark = mar_mark(L, ctx, buf);
+            mar_encode_open(L, buf, ctx, st, MAR_KTABLE, mark);
+        }
+
+        break;
+    }
+    case LUA_TUSERDATA: {
+        size_t ref = mar_ref(ctx, lua_topointer(L, -1));
+        const mar_Hook *hook;
+        if (ref) {
+            mar_encode_ref(L, buf, ctx, ref);
+        }
+        else if ((hook = mar_hook(L, -1)) != NULL) {
+            /* the metatable says which hook reads it back, so it has to
+             * be in the constants */
+            mar_Buffer *raw;
+            size_t mt;
+            lua_getmetatable(L, -1);
+            mt = mar_ref(ctx, lua_topointer(L, -1));
+            lua_pop(L, 1);
+            if (!mt) luaL_error(L, "metatable of a __marshal userdata is not a constant");
+            seen_put(L, ctx->objs, lua_topointer(L, -1), ctx->idx++);
+
+            raw = mar_scratch(L, ctx);
+            buf_reserve(L, raw, hook->size);
+            hook->write(L, lua_gettop(L), raw->data);
+            tag = MAR_TNAT;
+            buf_write(L, &tag, MAR_CHR, buf);
+            mar_write_size(L, ctx, buf, mt);
+            mar_write_size(L, ctx, buf, hook->size);
+            buf_write(L, raw->data, hook->size, buf);
+        }
+        else {
+            size_t mark;
+            if (luaL_getmetafield(L, -1, "__persist")) {
+                tag = MAR_TUSR;
+
+                ref = ctx->idx++;
+                seen_put(L, ctx->objs, lua_topointer(L, -2), ref);
+
+                lua_pushvalue(L, -2);
+                mar_stat(t0 = clock());
+                lua_call(L, 1, 1);
+                mar_stat(mar_stats.persist_time += clock() - t0);
+                mar_stat(mar_stats.persisted++);
+                if (!lua_isfunction(L, -1)) {
+                    luaL_error(L, "__persist must return a function");
+                }
+                /* the callback may be new, keep it alive while its address
+                 * is in the seen set */
+                lua_pushvalue(L, -1);
+                lua_rawseti(L, SEEN_IDX, (int)ref);
+                lua_newtable(L);
+                lua_pushvalue(L, -2);
+                lua_rawseti(L, -2, 1);
+                lua_remove(L, -2);
+
+                buf_write(L, &tag, MAR_CHR, buf);
+                mark = mar_mark(L, ctx, buf);
+                mar_encode_open(L, buf, ctx, st, MAR_KTABLE, mark);
+            }
+            else {
+                luaL_error(L, "attempt to encode userdata (no __persist hook)");
+            }
+        }
+        break;
+    }
+    case LUA_TNIL: break;
+    default:
+        luaL_error(L, "invalid value type (%s)", lua_typename(L, val_type));
+    }
+    mar_stat(mar_stats.bytes[stat_type] += mar_stat_pos(buf) - stat_pos);
+    lua_pop(L, 1);
+}
+
+/* True if the table on top of the stack can be written with the shape at
+ * prev, or as the first of a shape with the same keys as the table at prev
+ * when shape is 0: it is new, has no __persist hook and has the same string
+ * keys and no others. */
+static int mar_shape_match(lua_State *L, mar_Ctx *ctx, int prev, size_t shape)
+{
+    int val = lua_gettop(L);
+    size_t count = 0, n = 0;
+
+    if (lua_isnil(L, prev) || mar_ref(ctx, lua_topointer(L, val))) return 0;
+    if (luaL_getmetafield(L, val, "__persist")) {
+        lua_settop(L, val);
+        return 0;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, val) != 0) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TSTRING) break;
+        lua_pushvalue(L, -1);
+        lua_rawget(L, prev);
+        if (lua_isnil(L, -1)) break;
+        lua_pop(L, 1);
+        count++;
+    }
+    if (lua_gettop(L) != val) {
+        lua_settop(L, val);
+        return 0;
+    }
+
+    if (shape) {
+        n = lua_objlen(L, prev);
+    }
+    else {
+        lua_pushnil(L);
+        while (lua_next(L, prev) != 0 && n <= count) {
+            lua_pop(L, 1);
+            n++;
+        }
+        lua_settop(L, val);
+    }
+    return count > 0 && count == n;
+}
+
+/* writes the table on top of the stack, popping it, as shape number id with
+ * the keys listed in the table in the prev slot, including them if this is
+ * the first use */
+static void mar_encode_shaped
+    (lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, mar_Stack *st, size_t id, int def)
+{
+    char tag = LUA_TTABLE;
+    int keys = st->w + 3;
+    size_t i, n = lua_objlen(L, keys), l, mark;
+#ifdef MAR_STATS
+    size_t stat_pos = mar_stat_pos(buf);
+#endif
+
+    seen_put(L, ctx->objs, lua_topointer(L, -1), ctx->idx++);
+    mar_stat(mar_stats.tables++);
+
+    buf_write(L, &tag, MAR_CHR, buf);
+    tag = MAR_TSHP;
+    buf_write(L, &tag, MAR_CHR, buf);
+    mark = mar_mark(L, ctx, buf);
+    mar_write_size(L, ctx, buf, id);
+    if (def) {
+        mar_write_size(L, ctx, buf, n);
+        for (i = 1; i <= n; i++) {
+            const char *key;
+            lua_rawgeti(L, keys, i);
+            key = lua_tolstring(L, -1, &l);
+            mar_write_size(L, ctx, buf, l);
+            buf_write(L, key, l, buf);
+            lua_pop(L, 1);
+        }
+    }
+    mar_stat(mar_stats.bytes[LUA_TTABLE] += mar_stat_pos(buf) - stat_pos);
+    lua_pushvalue(L, keys);
+    lua_insert(L, -2);
+    mar_encode_open(L, buf, ctx, st, MAR_KSHAPE, mark);
+}
+
+/* Writes an entry of the top body, popping it. With the shapes option, the
+ * prev slot holds the previous entry if it was a table, or the keys of the
+ * shape it was written with (body->shape). A table with the same keys as
+ * the one before it starts a shape, and the tables after it with those keys
+ * reuse it. */
+static void mar_encode_entry(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, mar_Stack *st)
+{
+    mar_Body *body = &st->bodies[st->depth - 1];
+    int prev = st->w + 3;
+    if (ctx->shapes && lua_istable(L, -1)) {
+        if (mar_shape_match(L, ctx, prev, body->shape)) {
+            int def = body->shape == 0;
+            if (def) {
+                size_t i = 0;
+                lua_newtable(L);
+                lua_pushnil(L);
+                while (lua_next(L, -3) != 0) {
+                    lua_pop(L, 1);
+                    lua_pushvalue(L, -1);
+                    lua_rawseti(L, -3, ++i);
+                    lua_pushvalue(L, -1);
+                    lua_pushinteger(L, i);
+                    lua_rawset(L, -4);
+                }
+                lua_replace(L, prev);
+                body->shape = ++ctx->nshapes;
+            }
+            mar_encode_shaped(L, buf, ctx, st, body->shape, def);
+            return;
+        }
+        lua_pushvalue(L, -1);
+        lua_replace(L, prev);
+        body->shape = 0;
+    }
+    mar_encode_item(L, buf, -1, ctx, st);
+    lua_pop(L, 1);
+}
+
+/* finishes the top body: patches the size of its value, and brings back
+ * the slots of the one below */
+static void mar_encode_close(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, mar_Stack *st)
+{
+    mar_Body *body = &st->bodies[--st->depth];
+    const char end = LUA_TNIL;
+    int i;
+    if (body->kind == MAR_KTABLE) {
+        if (ctx->flags & MAR_FSTREAM) {
+            buf_write(L, &end, MAR_CHR, buf);
+        }
+        else if (body->nrec) {
+            luaL_error(L, "table changed while encoding");
+        }
+    }
+    mar_patch(L, ctx, buf, body->mark);
+    for (i = 1; i <= 3; i++) {
+        lua_rawgeti(L, st->w, 3 * (int)st->depth + i);
+        lua_replace(L, st->w + i);
+    }
+}
+
+/* table body: array count, hash count, values for 1..narr, then key/value
+ * pairs for everything else. Streamed bodies have no counts, instead both
+ * sections end with a nil type byte. Each call writes one entry (or key) of
+ * the top body, or closes it. */
+static void mar_encode_step(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx, mar_Stack *st)
+{
+    const char end = LUA_TNIL;
+    mar_Body *body = &st->bodies[st->depth - 1];
+    int t = st->w + 1, k = st->w + 2;
+
+    switch (body->state) {
+    case MAR_SARR:
+        if (!(ctx->flags & MAR_FSTREAM) && body->i > body->narr) {
+            body->state = MAR_SKEY;
+            break;
+        }
+        lua_rawgeti(L, t, (int)body->i);
+        if (ctx->flags & MAR_FSTREAM) {
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                buf_write(L, &end, MAR_CHR, buf);
+                body->state = MAR_SKEY;
+                break;
+            }
+            body->narr++;
+        }
+        body->i++;
+        if (body->index) {
+            lua_pushnumber(L, (lua_Number)(body->i - 1));
+            mar_index_add(L, body->index, -1, buf->head - body->start, ctx);
+            lua_pop(L, 1);
+        }
+        mar_encode_entry(L, buf, ctx, st);
+        break;
+    case MAR_SKEY:
+        lua_pushvalue(L, k);
+        if (lua_next(L, t) == 0) {
+            mar_encode_close(L, buf, ctx, st);
+            break;
+        }
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_replace(L, k);
+        if (lua_type(L, -1) == LUA_TNUMBER) {
+            lua_Number n = lua_tonumber(L, -1);
+            if (n >= 1 && n <= (lua_Number)body->narr && (lua_Number)(size_t)n == n) {
+                lua_pop(L, 1);
+                break;
+            }
+        }
+        body->state = MAR_SVAL;
+        mar_encode_item(L, buf, -1, ctx, st);
+        lua_pop(L, 1);
+        break;
+    case MAR_SVAL:
+        if (body->index) mar_index_add(L, body->index, k, buf->head - body->start, ctx);
+        if (!(ctx->flags & MAR_FSTREAM) && body->nrec-- == 0) {
+            luaL_error(L, "table changed while encoding");
+        }
+        body->state = MAR_SKEY;
+        lua_pushvalue(L, k);
+        lua_rawget(L, t);
+        mar_encode_entry(L, buf, ctx, st);
+        break;
+    case MAR_SSHP:
+        if (body->i > body->narr) {
+            mar_encode_close(L, buf, ctx, st);
+            break;
+        }
+        lua_rawgeti(L, st->w + 3, (int)body->i++);
+        lua_rawget(L, t);
+        mar_encode_item(L, buf, -1, ctx, st);
+        lua_pop(L, 1);
+        break;
+    }
+}
+
+static void mar_encode_value(lua_State *L, mar_Buffer *buf, int val, mar_Ctx *ctx)
+{
+    mar_Stack st;
+    int i;
+    lua_pushvalue(L, val);
+    lua_newtable(L);
+    st.w = lua_gettop(L);
+    for (i = 1; i <= 3; i++) lua_pushnil(L);
+    st.depth = 0;
+    st.nbodies = MAR_FRAMES;
+    st.bodies = st.inline_bodies;
+    mar_stat(mar_stats.encodes++);
+
+    mar_encode_item(L, buf, st.w - 1, ctx, &st);
+    while (st.depth > 0) {
+        mar_encode_step(L, buf, ctx, &st);
+    }
+    lua_settop(L, st.w - 2);
+}
+
+static void mar_load(lua_State *L, const char *code, size_t l)
+{
+    mar_Buffer dec_buf;
+    dec_buf.data = (char*)code;
+    dec_buf.size = l;
+    dec_buf.head = l;
+    dec_buf.seek = 0;
+#if LUA_VERSION_NUM >= 502
+    if (lua_load(L, (lua_Reader)buf_read, &dec_buf, "=marshal", "b") != 0) {
+        lua_error(L);
+    }
+    else {
+        /* lua_load binds the first upvalue to the globals, whatever its
+         * name; only _ENV should be, the rest start out nil */
+        const char *name;
+        int i;
+        for (i = 1; (name = lua_getupvalue(L, -1, i)) != NULL; i++) {
+            lua_pop(L, 1);
+            if (strcmp(name, "_ENV") == 0) {
+                lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+            }
+            else {
+                lua_pushnil(L);
+            }
+            lua_setupvalue(L, -2, i);
+        }
+    }
+#else
+    if (lua_load(L, (lua_Reader)buf_read, &dec_buf, "=marshal") != 0) {
+        lua_error(L);
+    }
+#endif
+}
+
+/* The decoder is a state machine over an explicit stack of frames, one for
+ * each table, __persist payload or upvalue list being filled, so it can stop
+ * at any byte and pick up again when more input arrives. A token is only
+ * consumed once all of its bytes are there.
+ *
+ * While it runs, the object of the top frame sits at MAR_T_IDX and a pending
+ * hash key at MAR_K_IDX. Pushing frame d saves the parent's pair in the seen
+ * table at -2d+1 and -2d; the decoded value goes to index 0. */
+static int dec_var(lua_State *L, mar_Decoder *d, uint64_t *v)
+{
+    size_t pos = d->pos;
+    uint64_t r = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (pos >= d->len) return 0;
+        if (shift > 63) luaL_error(L, "bad code");
+        c = (unsigned char)d->data[pos++];
+        r |= (uint64_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    d->pos = pos;
+    *v = r;
+    return 1;
+}
+
+static int dec_size(lua_State *L, mar_Decoder *d, size_t *n)
+{
+    if (d->ctx.flags & MAR_FCOMPACT) {
+        uint64_t v;
+        if (!dec_var(L, d, &v)) return 0;
+        if (v > (size_t)-1) luaL_error(L, "bad code");
+        *n = (size_t)v;
+    }
+    else {
+        if (dec_avail(d) < MAR_I32) return 0;
+        *n = mar_get32(d->data + d->pos);
+        d->pos += MAR_I32;
+    }
+    return 1;
+}
+
+static void dec_push(lua_State *L, mar_Decoder *d, int kind, size_t ref)
+{
+    mar_Frame *fr;
+    if (d->depth == d->nframes) {
+        mar_Frame *frames;
+        if (d->nframes > ((size_t)-1 / 2) / sizeof(mar_Frame)) {
+            luaL_error(L, "nesting too deep");
+        }
+        lua_pushlightuserdata(L, (void*)&mar_frames_key);
+        frames = (mar_Frame*)lua_newuserdata(L, 2 * d->nframes * sizeof(mar_Frame));
+        memcpy(frames, d->frames, d->nframes * sizeof(mar_Frame));
+        lua_rawset(L, SEEN_IDX);
+        d->frames = frames;
+        d->nframes *= 2;
+    }
+    lua_pushvalue(L, MAR_T_IDX);
+    lua_rawseti(L, SEEN_IDX, -2 * (int)d->depth - 1);
+    lua_pushvalue(L, MAR_K_IDX);
+    lua_rawseti(L, SEEN_IDX, -2 * (int)d->depth - 2);
+
+    fr = &d->frames[d->depth++];
+    fr->kind = kind;
+    fr->state = MAR_SHEAD;
+    fr->narr = 0;
+    fr->nrec = 0;
+    fr->i = 1;
+    fr->end = 0;
+    fr->ref = ref;
+    if (kind == MAR_KUPVALS) {
+        lua_replace(L, MAR_T_IDX);
+    }
+}
+
+/* stores the value on top of the stack into the top frame */
+static void dec_deliver(lua_State *L, mar_Decoder *d)
+{
+    mar_Frame *fr;
+    if (d->depth == 0) {
+        lua_rawseti(L, SEEN_IDX, 0);
+        d->done = 1;
+        return;
+    }
+    fr = &d->frames[d->depth - 1];
+    switch (fr->state) {
+    case MAR_SARR:
+        if (fr->kind != MAR_KUPVALS) {
+            lua_rawseti(L, MAR_T_IDX, fr->i);
+        }
+        else if (!lua_setupvalue(L, MAR_T_IDX, fr->i)) {
+            lua_pop(L, 1);
+        }
+        fr->i++;
+        if (fr->narr) fr->narr--;
+        break;
+    case MAR_SKEY:
+        lua_replace(L, MAR_K_IDX);
+        fr->state = MAR_SVAL;
+        break;
+    case MAR_SSHP:
+        lua_rawgeti(L, MAR_K_IDX, fr->i++);
+        lua_insert(L, -2);
+        lua_rawset(L, MAR_T_IDX);
+        fr->narr--;
+        break;
+    case MAR_SVAL:
+        if (fr->kind != MAR_KUPVALS) {
+            lua_pushvalue(L, MAR_K_IDX);
+            lua_insert(L, -2);
+            lua_rawset(L, MAR_T_IDX);
+        }
+        else if (!lua_isnumber(L, MAR_K_IDX)
+              || !lua_setupvalue(L, MAR_T_IDX, (int)lua_tointeger(L, MAR_K_IDX))) {
+            lua_pop(L, 1);
+        }
+        if (fr->nrec) fr->nrec--;
+        fr->state = MAR_SKEY;
+        break;
+    }
+}
+
+/* finishes the top frame and hands its value to the one below */
+static void dec_pop(lua_State *L, mar_Decoder *d)
+{
+    mar_Frame *fr = &d->frames[d->depth - 1];
+    int depth = (int)d->depth;
+    if (!(d->ctx.flags & MAR_FSTREAM) && d->offset + d->pos != fr->end) {
+        luaL_error(L, "bad code");
+    }
+    if (fr->kind == MAR_KPERSIST) {
+        lua_rawgeti(L, MAR_T_IDX, 1);
+        lua_call(L, 0, 1);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, SEEN_IDX, fr->ref);
+    }
+    else {
+        lua_pushvalue(L, MAR_T_IDX);
+    }
+    lua_rawgeti(L, SEEN_IDX, -2 * depth + 1);
+    lua_replace(L, MAR_T_IDX);
+    lua_rawgeti(L, SEEN_IDX, -2 * depth);
+    lua_replace(L, MAR_K_IDX);
+    d->depth--;
+    dec_deliver(L, d);
+}
+
+/* reads the shape of a shaped table, defining it if it is new */
+static int dec_shape(lua_State *L, mar_Decoder *d, mar_Frame *fr)
+{
+    size_t save = d->pos, l, id, n = 0, i;
+    if (!(d->ctx.flags & MAR_FSTREAM)) {
+        if (!dec_size(L, d, &l)) return 0;
+        fr->end = d->offset + d->pos + l;
+    }
+    if (!dec_size(L, d, &id)) {
+        d->pos = save;
+        return 0;
+    }
+    if (id == d->ctx.nshapes + 1) {
+        size_t keys;
+        if (!dec_size(L, d, &n)) {
+            d->pos = save;
+            return 0;
+        }
+        if (n > d->len) luaL_error(L, "bad code");
+        /* make sure all the keys are here before creating any */
+        keys = d->pos;
+        for (i = 0; i < n; i++) {
+            if (!dec_size(L, d, &l) || dec_avail(d) < l) {
+                d->pos = save;
+                return 0;
+            }
+            d->pos += l;
+        }
+        d->pos = keys;
+        mar_push_shapes(L);
+        lua_createtable(L, n, 0);
+        for (i = 1; i <= n; i++) {
+            dec_size(L, d, &l);
+            lua_pushlstring(L, d->data + d->pos, l);
+            d->pos += l;
+            lua_rawseti(L, -2, i);
+        }
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, ++d->ctx.nshapes);
+        lua_remove(L, -2);
+    }
+    else if (id >= 1 && id <= d->slim) {
+        d->pos = save;
+        d->outside = 1;
+        return 0;
+    }
+    else if (id >= 1 && id <= d->ctx.nshapes) {
+        mar_push_shapes(L);
+        lua_rawgeti(L, -1, id);
+        lua_remove(L, -2);
+        n = lua_objlen(L, -1);
+    }
+    else {
+        luaL_error(L, "bad code");
+    }
+
+    lua_createtable(L, 0, n);
+    lua_replace(L, MAR_T_IDX);
+    lua_replace(L, MAR_K_IDX);
+    lua_pushvalue(L, MAR_T_IDX);
+    lua_rawseti(L, SEEN_IDX, fr->ref);
+    fr->narr = n;
+    fr->state = MAR_SSHP;
+    return 1;
+}
+
+/* reads the body header of the top frame and makes its table */
+static int dec_head(lua_State *L, mar_Decoder *d, mar_Frame *fr)
+{
+    size_t save = d->pos, l, narr = 0, nrec = 0;
+    if (fr->kind == MAR_KSHAPE) {
+        return dec_shape(L, d, fr);
+    }
+    if (!(d->ctx.flags & MAR_FSTREAM)) {
+        if (!dec_size(L, d, &l)) return 0;
+        fr->end = d->offset + d->pos + l;
+        if (!dec_size(L, d, &narr) || !dec_size(L, d, &nrec)) {
+            d->pos = save;
+            return 0;
+        }
+        if (narr > l || nrec > l / 2) luaL_error(L, "bad code");
+    }
+    if (fr->kind != MAR_KUPVALS) {
+        /* only presize for what could be in the input so far */
+        size_t avail = dec_avail(d);
+        lua_createtable(L, narr < avail ? narr : avail, nrec < avail ? nrec : avail);
+        lua_replace(L, MAR_T_IDX);
+        if (fr->kind == MAR_KTABLE) {
+            lua_pushvalue(L, MAR_T_IDX);
+            lua_rawseti(L, SEEN_IDX, fr->ref);
+        }
+    }
+    fr->narr = narr;
+    fr->nrec = nrec;
+    fr->state = MAR_SARR;
+    return 1;
+}
+
+/* pushes seen[ref], unless it is outside of what the decoder can see */
+static int dec_ref(lua_State *L, mar_Decoder *d, size_t ref)
+{
+    if (ref >= d->lo && ref < d->hi) {
+        d->outside = 1;
+        return 0;
+    }
+    lua_rawgeti(L, SEEN_IDX, ref);
+    if (lua_isnil(L, -1)) {
+        /* the constants of a marshal.constants aren't copied in */
+        lua_pushlightuserdata(L, (void*)&mar_constants_key);
+        lua_rawget(L, SEEN_IDX);
+        if (lua_istable(L, -1)) {
+            lua_rawgeti(L, -1, ref);
+            lua_replace(L, -3);
+        }
+        lua_pop(L, 1);
+    }
+    return 1;
+}
+
+/* Decodes a packed array ending at end into the table at t, or into a new
+ * table pushed on the stack if t is 0. All of it is in the input. */
+static void dec_packed(lua_State *L, mar_Decoder *d, size_t end, int t)
+{
+    size_t len = d->len, n, i, l;
+    uint64_t zz = 0;
+    int kind;
+    d->len = end; /* nothing past the array is read */
+    if (d->pos >= end) luaL_error(L, "bad code");
+    kind = (unsigned char)d->data[d->pos++];
+    if (!dec_size(L, d, &n) || n > dec_avail(d)) luaL_error(L, "bad code");
+    if (t == 0) {
+        lua_createtable(L, (int)n, 0);
+        t = lua_gettop(L);
+    }
+    switch (kind) {
+    case MAR_PNUM:
+        if (n != dec_avail(d) / MAR_I64) luaL_error(L, "bad code");
+        for (i = 1; i <= n; i++) {
+            lua_pushnumber(L, mar_get_num(d->data + d->pos));
+            d->pos += MAR_I64;
+            lua_rawseti(L, t, (int)i);
+        }
+        break;
+    case MAR_PINT:
+        for (i = 1; i <= n; i++) {
+            if (!dec_var(L, d, &zz)) luaL_error(L, "bad code");
+            mar_pushint(L, mar_unzigzag(zz));
+            lua_rawseti(L, t, (int)i);
+        }
+        break;
+    case MAR_PSTR:
+        for (i = 1; i <= n; i++) {
+            if (!dec_var(L, d, &zz) || zz > dec_avail(d)) luaL_error(L, "bad code");
+            l = (size_t)zz;
+            lua_pushlstring(L, d->data + d->pos, l);
+            d->pos += l;
+            lua_rawseti(L, t, (int)i);
+        }
+        break;
+    default:
+        luaL_error(L, "bad code");
+    }
+    if (d->pos != end) luaL_error(L, "bad code");
+    d->len = len;
+}
+
+#define dec_need(c) if (!(c)) { d->pos = save; return MAR_MORE; }
+
+/* reads one value. Scalars and refs are pushed (MAR_VALUE), tables and
+ * functions push a frame instead (MAR_FRAME) */
+static int dec_value(lua_State *L, mar_Decoder *d)
+{
+    size_t save = d->pos, l;
+    char tag;
+    int val_type;
+
+    dec_need(d->pos < d->len);
+    val_type = (unsigned char)d->data[d->pos++];
+    switch (val_type) {
+    case LUA_TBOOLEAN:
+        dec_need(dec_avail(d) >= MAR_CHR);
+        lua_pushboolean(L, d->data[d->pos++]);
+        break;
+    case LUA_TNUMBER:
+        dec_need(dec_avail(d) >= MAR_I64);
+        lua_pushnumber(L, mar_get_num(d->data + d->pos));
+        d->pos += MAR_I64;
+        break;
+    case MAR_TINT: {
+        uint64_t zz;
+        dec_need(dec_var(L, d, &zz));
+        mar_pushint(L, mar_unzigzag(zz));
+        break;
+    }
+    case LUA_TSTRING:
+    case MAR_TSTR:
+        dec_need(dec_size(L, d, &l));
+        dec_need(dec_avail(d) >= l);
+        lua_pushlstring(L, d->data + d->pos, l);
+        d->pos += l;
+        if (val_type == MAR_TSTR) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, SEEN_IDX, d->ctx.idx++);
+        }
+        break;
+    case MAR_TSRF:
+        dec_need(dec_size(L, d, &l));
+        dec_need(dec_ref(L, d, l));
+        break;
+    case LUA_TTABLE:
+    case LUA_TUSERDATA:
+        dec_need(d->pos < d->len);
+        tag = d->data[d->pos++];
+        if (tag == MAR_TREF) {
+            dec_need(dec_size(L, d, &l));
+            dec_need(dec_ref(L, d, l));
+        }
+        else if (tag == MAR_TVAL && val_type == LUA_TTABLE) {
+            dec_push(L, d, MAR_KTABLE, d->ctx.idx++);
+            return MAR_FRAME;
+        }
+        else if (tag == MAR_TSHP && val_type == LUA_TTABLE) {
+            dec_push(L, d, MAR_KSHAPE, d->ctx.idx++);
+            return MAR_FRAME;
+        }
+        else if (tag == MAR_TPKD && val_type == LUA_TTABLE) {
+            dec_need(dec_size(L, d, &l));
+            dec_need(dec_avail(d) >= l);
+            dec_packed(L, d, d->pos + l, 0);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, SEEN_IDX, d->ctx.idx++);
+        }
+        else if (tag == MAR_TUSR) {
+            /* numbered before its payload, as the encoder does */
+            dec_push(L, d, MAR_KPERSIST, d->ctx.idx++);
+            return MAR_FRAME;
+        }
+        else if (tag == MAR_TNAT && val_type == LUA_TUSERDATA) {
+            const mar_Hook *hook;
+            size_t mt;
+            dec_need(dec_size(L, d, &mt));
+            dec_need(dec_size(L, d, &l));
+            dec_need(dec_avail(d) >= l);
+            dec_need(dec_ref(L, d, mt));
+            hook = mar_hook(L, -1);
+            if (!hook || hook->size != l) luaL_error(L, "no __marshal hook to read userdata");
+            lua_pop(L, 1);
+            hook->read(L, d->data + d->pos);
+            d->pos += l;
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, SEEN_IDX, d->ctx.idx++);
+        }
+        else if (tag == MAR_TVAL) {
+            lua_pushnil(L);
+        }
+        else {
+            luaL_error(L, "bad encoded data");
+        }
+        break;
+    case LUA_TFUNCTION: {
+        const char *code;
+        dec_need(d->pos < d->len);
+        tag = d->data[d->pos++];
+        if (tag == MAR_TREF) {
+            dec_need(dec_size(L, d, &l));
+            dec_need(dec_ref(L, d, l));
+            break;
+        }
+        if (tag == MAR_TVAL) {
+            dec_need(dec_size(L, d, &l));
+            dec_need(dec_avail(d) >= l);
+            mar_push_protos(L);
+            lua_pushlstring(L, d->data + d->pos, l);
+            d->pos += l;
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, ++d->ctx.nprotos);
+        }
+        else if (tag == MAR_TPRO) {
+            dec_need(dec_size(L, d, &l));
+            if (l <= d->plim) d->outside = 1;
+            dec_need(l > d->plim);
+            if (l < 1 || l > d->ctx.nprotos) luaL_error(L, "bad code");
+            mar_push_protos(L);
+            lua_rawgeti(L, -1, l);
+        }
+        else {
+            luaL_error(L, "bad encoded data");
+        }
+        code = lua_tolstring(L, -1, &l);
+        mar_load(L, code, l);
+        lua_replace(L, -3);
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, SEEN_IDX, d->ctx.idx++);
+        dec_push(L, d, MAR_KUPVALS, 0);
+        return MAR_FRAME;
+    }
+    case LUA_TNIL:
+    case LUA_TTHREAD:
+        lua_pushnil(L);
+        break;
+    default:
+        luaL_error(L, "bad code");
+    }
+    return MAR_VALUE;
+}
+
+static int dec_magic(lua_State *L, mar_Decoder *d)
+{
+    unsigned char c;
+    if (d->header == 0) {
+        if (d->pos >= d->len) return 0;
+        if ((unsigned char)d->data[d->pos] == MAR_MAGIC_OLD) {
+            luaL_error(L, "unsupported format version");
+        }
+        if ((unsigned char)d->data[d->pos] != MAR_MAGIC) luaL_error(L, "bad magic");
+        d->pos++;
+        d->header = 1;
+    }
+    if (d->pos >= d->len) return 0;
+    c = (unsigned char)d->data[d->pos];
+    if (c & MAR_FHEAD) {
+        d->ctx.flags = c & ~MAR_FHEAD;
+        if (d->ctx.flags & ~MAR_FALL) luaL_error(L, "bad header");
+        if ((d->ctx.flags & MAR_FMANY) && !d->many) {
+            luaL_error(L, "input is a batch, use decode_many");
+        }
+        if ((d->ctx.flags & MAR_FDIFF) && !d->delta) {
+            luaL_error(L, "input is a delta, use patch");
+        }
+        d->pos++;
+    }
+    if (d->delta && !(d->ctx.flags & MAR_FDIFF)) luaL_error(L, "input is not a delta");
+    d->header = 2;
+    return 1;
+}
+
+/* true if a section of a streamed body ends here, skipping the marker */
+static int dec_end(mar_Decoder *d)
+{
+    if (d->data[d->pos] != LUA_TNIL) return 0;
+    d->pos++;
+    return 1;
+}
+
+/* decodes as far as the input goes, true once the value is complete */
+static int dec_run(lua_State *L, mar_Decoder *d)
+{
+    int stream;
+    while (!d->done) {
+        if (d->header < 2) {
+            if (!dec_magic(L, d)) return 0;
+            continue;
+        }
+        stream = d->ctx.flags & MAR_FSTREAM;
+        if (d->depth > 0) {
+            mar_Frame *fr = &d->frames[d->depth - 1];
+            switch (fr->state) {
+            case MAR_SHEAD:
+                if (!dec_head(L, d, fr)) return 0;
+                continue;
+            case MAR_SARR:
+                if (stream && d->pos >= d->len) return 0;
+                if (stream ? dec_end(d) : fr->narr == 0) {
+                    fr->state = MAR_SKEY;
+                    continue;
+                }
+                break;
+            case MAR_SKEY:
+                if (stream && d->pos >= d->len) return 0;
+                if (stream ? dec_end(d) : fr->nrec == 0) {
+                    dec_pop(L, d);
+                    continue;
+                }
+                break;
+            case MAR_SSHP:
+                if (fr->narr == 0) {
+                    dec_pop(L, d);
+                    continue;
+                }
+                break;
+            }
+        }
+        switch (dec_value(L, d)) {
+        case MAR_MORE:
+            return 0;
+        case MAR_VALUE:
+            dec_deliver(L, d);
+            break;
+        }
+    }
+    return 1;
+}
+
+static void dec_init(mar_Decoder *d, size_t idx)
+{
+    d->ctx.idx = idx;
+    d->ctx.flags = 0;
+    d->ctx.strmin = 0;
+    d->ctx.threads = 1;
+    d->ctx.nprotos = 0;
+    d->ctx.shapes = 0;
+    d->ctx.portable = 0;
+    d->ctx.nshapes = 0;
+    d->ctx.scratch = NULL;
+    d->ctx.objs = NULL;
+    d->ctx.consts = NULL;
+    d->ctx.arena = NULL;
+    d->data = NULL;
+    d->len = 0;
+    d->pos = 0;
+    d->offset = 0;
+    d->header = 0;
+    d->done = 0;
+    d->many = 0;
+    d->delta = 0;
+    d->outside = 0;
+    d->lo = 0;
+    d->hi = 0;
+    d->plim = 0;
+    d->slim = 0;
+    d->depth = 0;
+    d->nframes = MAR_FRAMES;
+    d->frames = d->inline_frames;
+    d->in.data = NULL;
+    d->zstate = MAR_ZHEAD;
+    d->nzhead = 0;
+    d->z.data = NULL;
+}
+
+static int lz_var(lua_State *L, const char *s, size_t l, size_t *pos, size_t *v)
+{
+    size_t p = *pos, r = 0;
+    int shift = 0;
+    unsigned char c;
+    do {
+        if (p >= l) return 0;
+        if (shift > 28) luaL_error(L, "bad code");
+        c = (unsigned char)s[p++];
+        r |= (size_t)(c & 0x7f) << shift;
+        shift += 7;
+    } while (c & 0x80);
+    *pos = p;
+    *v = r;
+    return 1;
+}
+
+/* reads the header of the block at *pos: false if incomplete */
+static int lz_head(lua_State *L, const char *s, size_t l, size_t *pos, size_t *n, size_t *c)
+{
+    size_t p = *pos;
+    if (!lz_var(L, s, l, &p, n)) return 0;
+    if (*n == 0) {
+        *c = 0;
+    }
+    else {
+        if (!lz_var(L, s, l, &p, c)) return 0;
+        if (*n > MAR_BLOCK_SIZE || *c >= *n) luaL_error(L, "bad code");
+        if (l - p < (*c ? *c : *n)) return 0;
+    }
+    *pos = p;
+    return 1;
+}
+
+static void lz_unpack(lua_State *L, const char *src, size_t n, size_t c, char *dst)
+{
+    if (c == 0) {
+        memcpy(dst, src, n);
+    }
+    else if (!lz_decompress((const unsigned char*)src, c, (unsigned char*)dst, n)) {
+        luaL_error(L, "bad code");
+    }
+}
+
+/* room for n more bytes at the end of a decoder's buffer */
+static char *dec_space(lua_State *L, mar_Decoder *d, size_t n)
+{
+    if (d->in.data == NULL) {
+        buf_init(L, &d->in, d->ctx.arena);
+    }
+    else if (d->pos > 0 && d->pos >= d->in.head / 2) {
+        memmove(d->in.data, d->in.data + d->pos, d->in.head - d->pos);
+        d->in.head -= d->pos;
+        d->offset += d->pos;
+        d->pos = 0;
+    }
+    if (d->in.size - d->in.head < n) {
+        size_t size = 2 * d->in.size;
+        buf_reserve(L, &d->in, size - d->in.head < n ? d->in.head + n : size);
+    }
+    return d->in.data + d->in.head;
+}
+
+static void dec_append(lua_State *L, mar_Decoder *d, const char *s, size_t l)
+{
+    memcpy(dec_space(L, d, l), s, l);
+    d->in.head += l;
+    d->data = d->in.data;
+    d->len = d->in.head;
+}
+
+/* unpacks and decodes the whole blocks at s, returning the bytes used */
+static size_t dec_blocks(lua_State *L, mar_Decoder *d, const char *s, size_t l)
+{
+    size_t pos = 0, n, c;
+    while (d->zstate == MAR_ZBLOCK && lz_head(L, s, l, &pos, &n, &c)) {
+        if (n == 0 || d->done) {
+            d->zstate = MAR_ZEND;
+            return l;
+        }
+        lz_unpack(L, s + pos, n, c, dec_space(L, d, n));
+        pos += c ? c : n;
+        d->in.head += n;
+        d->data = d->in.data;
+        d->len = d->in.head;
+        dec_run(L, d);
+    }
+    return pos;
+}
+
+/* Input of a decoder object and of compressed decodes goes through here.
+ * Once the header shows the input is compressed, blocks are unpacked one
+ * at a time into the decoder's buffer and the header is passed on without
+ * the compress flag, so the decoder proper never sees compressed bytes. */
+static void dec_input(lua_State *L, mar_Decoder *d, const char *s, size_t l)
+{
+    if (d->zstate == MAR_ZHEAD) {
+        while (d->nzhead < MAR_HEAD_SIZE && l > 0) {
+            d->zhead[d->nzhead++] = *s++;
+            l--;
+        }
+        if (d->nzhead < MAR_HEAD_SIZE) return;
+        if (mar_is_lz(d->zhead)) {
+            char head[MAR_HEAD_SIZE];
+            int flags = (unsigned char)d->zhead[1] & ~(MAR_FHEAD | MAR_FLZ);
+            head[0] = (char)MAR_MAGIC;
+            head[1] = (char)(MAR_FHEAD | flags);
+            dec_append(L, d, head, flags ? 2 : 1);
+            d->zstate = MAR_ZBLOCK;
+        }
+        else {
+            dec_append(L, d, d->zhead, MAR_HEAD_SIZE);
+            d->zstate = MAR_ZRAW;
+        }
+    }
+    if (d->zstate == MAR_ZRAW) {
+        dec_append(L, d, s, l);
+        dec_run(L, d);
+    }
+    else if (d->zstate == MAR_ZBLOCK) {
+        size_t used;
+        if (d->z.data && d->z.head > 0) {
+            buf_write(L, s, l, &d->z);
+            used = dec_blocks(L, d, d->z.data, d->z.head);
+            memmove(d->z.data, d->z.data + used, d->z.head - used);
+            d->z.head -= used;
+        }
+        else if ((used = dec_blocks(L, d, s, l)) < l) {
+            if (d->z.data == NULL) buf_init(L, &d->z, d->ctx.arena);
+            buf_write(L, s + used, l - used, &d->z);
+        }
+    }
+}
+
+/* pushes a userdata holding the compressed input at s unpacked, header
+ * included, and returns its contents */
+static const char *mar_inflate(lua_State *L, const char *s, size_t l, size_t *out)
+{
+    size_t pos = MAR_HEAD_SIZE, total = 0, n, c, hl;
+    int flags = (unsigned char)s[1] & ~(MAR_FHEAD | MAR_FLZ);
+    char *p;
+
+    for (;;) {
+        if (!lz_head(L, s, l, &pos, &n, &c)) luaL_error(L, "bad code");
+        if (n == 0) break;
+        if (total > (size_t)-1 - n) luaL_error(L, "bad code");
+        total += n;
+        pos += c ? c : n;
+    }
+    hl = flags ? 2 : 1;
+    p = (char*)lua_newuserdata(L, hl + total);
+    p[0] = (char)MAR_MAGIC;
+    if (flags) p[1] = (char)(MAR_FHEAD | flags);
+    *out = hl;
+    for (pos = MAR_HEAD_SIZE; lz_head(L, s, l, &pos, &n, &c) && n > 0; pos += c ? c : n) {
+        lz_unpack(L, s + pos, n, c, p + *out);
+        *out += n;
+    }
+    return p;
+}
+
+static mar_Decoder *mar_push_decoder(lua_State *L, size_t idx)
+{
+    mar_Decoder *d = (mar_Decoder*)lua_newuserdata(L, sizeof(mar_Decoder));
+    dec_init(d, idx);
+    d->failed = 0;
+    luaL_getmetatable(L, MAR_DECODER);
+    lua_setmetatable(L, -2);
+    return d;
+}
+
+
+/* true if the value at idx is a userdata with the named metatable */
+static int mar_isudata(lua_State *L, int idx, const char *tname)
+{
+    int r;
+    if (!lua_isuserdata(L, idx) || !lua_getmetatable(L, idx)) return 0;
+    luaL_getmetatable(L, tname);
+    r = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    return r;
+}
+
+static void mar_check_constants(lua_State *L, int narg, const char *fname)
+{
+    if (lua_isnil(L, 2)) {
+        lua_newtable(L);
+        lua_replace(L, 2);
+    }
+    else if (!lua_istable(L, 2) && !mar_isudata(L, 2, MAR_CONSTANTS)) {
+        luaL_error(L, "bad argument #%d to %s (expected table)", narg, fname);
+    }
+}
+
+static mar_Constants *mar_toconstants(lua_State *L, int idx)
+{
+    return mar_isudata(L, idx, MAR_CONSTANTS) ? (mar_Constants*)lua_touserdata(L, idx) : NULL;
+}
+
+/* replaces a marshal.constants at index 2 with its list, for the callers
+ * that go through the constants one by one */
+static void mar_constants_list(lua_State *L)
+{
+    if (mar_toconstants(L, 2)) {
+        lua_getfenv(L, 2);
+        lua_replace(L, 2);
+    }
+}
+
+static void mar_check_options(lua_State *L, int narg, const char *fname, mar_Ctx *ctx)
+{
+    ctx->flags = 0;
+    ctx->strmin = 0;
+    ctx->shapes = 0;
+    ctx->portable = 0;
+    ctx->threads = 1;
+    ctx->objs = NULL;
+    ctx->consts = NULL;
+    ctx->arena = NULL;
+    if (lua_isnoneornil(L, narg)) {
+        return;
+    }
+    if (!lua_istable(L, narg)) {
+        luaL_error(L, "bad argument #%d to %s (expected table)", narg, fname);
+    }
+    lua_getfield(L, narg, "compact");
+    if (lua_toboolean(L, -1)) ctx->flags |= MAR_FCOMPACT;
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "index");
+    if (lua_toboolean(L, -1)) ctx->flags |= MAR_FINDEX;
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "compress");
+    if (lua_toboolean(L, -1)) ctx->flags |= MAR_FLZ;
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "shapes");
+    ctx->shapes = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "portable");
+    ctx->portable = lua_toboolean(L, -1);
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "threads");
+    if (!lua_isnil(L, -1) && !(ctx->flags & MAR_FLZ)) {
+        luaL_error(L, "bad argument #%d to %s (threads needs compress)", narg, fname);
+    }
+    if (lua_isnumber(L, -1) && lua_tonumber(L, -1) > 1) {
+        ctx->threads = lua_tonumber(L, -1) > 1024 ? 1024 : (int)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+    lua_getfield(L, narg, "intern");
+    if (lua_isnumber(L, -1)) {
+        lua_Integer n = lua_tointeger(L, -1);
+        ctx->strmin = n < 1 ? 1 : (size_t)n;
+    }
+    else if (lua_toboolean(L, -1)) {
+        ctx->strmin = MAR_INTERN_MIN;
+    }
+    lua_pop(L, 1);
+}
+
+/* enters the constants at index 2 in the seen set (objects) or table
+ * (anything else) and returns the next seen index */
+static size_t mar_encode_seen(lua_State *L, mar_Ctx *ctx)
+{
+    size_t idx, len;
+    mar_Constants *k = mar_toconstants(L, 2);
+    if (!ctx->objs) mar_own(L, ctx);
+    if (k) {
+        ctx->consts = &k->objs;
+        return k->n + 1;
+    }
+    ctx->consts = NULL;
+    len = lua_objlen(L, 2);
+    for (idx = 1; idx <= len; idx++) {
+        lua_rawgeti(L, 2, idx);
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            lua_pop(L, 1);
+            break;
+        case LUA_TTABLE:
+        case LUA_TFUNCTION:
+        case LUA_TUSERDATA:
+            seen_put(L, ctx->objs, lua_topointer(L, -1), idx);
+            lua_pop(L, 1);
+            break;
+        default:
+            lua_pushinteger(L, idx);
+            lua_rawset(L, SEEN_IDX);
+        }
+    }
+    return idx;
+}
+
+static size_t mar_decode_seen(lua_State *L)
+{
+    size_t idx, len;
+    mar_Constants *k = mar_toconstants(L, 2);
+    if (k) {
+        lua_pushlightuserdata(L, (void*)&mar_constants_key);
+        lua_getfenv(L, 2);
+        lua_rawset(L, SEEN_IDX);
+        return k->n + 1;
+    }
+    len = lua_objlen(L, 2);
+    for (idx = 1; idx <= len; idx++) {
+        lua_rawgeti(L, 2, idx);
+        lua_rawseti(L, SEEN_IDX, idx);
+    }
+    return idx;
+}
+
+/* constants(list): the list entered once, for encode and decode to take
+ * in its place without setting it up each call. Later changes to the list
+ * don't show. */
+static int mar_constants(lua_State *L)
+{
+    size_t i, n;
+    mar_Constants *k;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    n = lua_objlen(L, 1);
+    k = (mar_Constants*)lua_newuserdata(L, sizeof(mar_Constants));
+    k->n = n;
+    memset(&k->objs, 0, sizeof(k->objs));
+    luaL_getmetatable(L, MAR_CONSTANTS);
+    lua_setmetatable(L, -2);
+
+    lua_createtable(L, (int)n, 0);
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, 1, i);
+        switch (lua_type(L, -1)) {
+        case LUA_TNIL:
+            lua_pop(L, 1);
+            continue;
+        case LUA_TTABLE:
+        case LUA_TFUNCTION:
+        case LUA_TUSERDATA:
+            seen_put(L, &k->objs, lua_topointer(L, -1), i);
+            break;
+        case LUA_TSTRING:
+            lua_pushvalue(L, -1);
+            lua_pushinteger(L, i);
+            lua_rawset(L, -4);
+        }
+        lua_rawseti(L, -2, i);
+    }
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+static int mar_constants_gc(lua_State *L)
+{
+    mar_Constants *k = (mar_Constants*)luaL_checkudata(L, 1, MAR_CONSTANTS);
+    seen_free(L, &k->objs);
+    k->objs.slots = NULL;
+    return 0;
+}
+
+static int mar_constants_len(lua_State *L)
+{
+    mar_Constants *k = (mar_Constants*)luaL_checkudata(L, 1, MAR_CONSTANTS);
+    lua_pushnumber(L, (lua_Number)k->n);
+    return 1;
+}
+
+static void mar_encode_head(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx)
+{
+    unsigned char m = MAR_MAGIC;
+    buf_write(L, (void*)&m, 1, buf);
+    if (ctx->flags) {
+        m = MAR_FHEAD | ctx->flags;
+        buf_write(L, (void*)&m, 1, buf);
+    }
+}
+
+static void mar_encode_buf(lua_State *L, mar_Buffer *buf, mar_Ctx *ctx)
+{
+    mar_Encoder *ienc = NULL;
+    mar_encode_head(L, buf, ctx);
+
+    ctx->index = NULL;
+    if (ctx->flags & MAR_FINDEX) {
+        ienc = mar_push_encoder(L, ctx);
+        ctx->index = &ienc->buf;
+    }
+    lua_pushvalue(L, 1);
+    mar_encode_value(L, buf, -1, ctx);
+    lua_pop(L, 1);
+    if (ienc) {
+        mar_write_index(L, buf, ienc);
+        lua_pop(L, 1);
+    }
+}
+
+static void mar_clear_table(lua_State *L, int t)
+{
+    lua_pushnil(L);
+    while (lua_next(L, t) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, t);
+    }
+}
+
+static int mar_encode_as(lua_State* L, const char *fname, int flags)
+{
+    mar_Ctx ctx;
+    mar_Encoder *enc;
+
+    mar_check_options(L, 3, fname, &ctx);
+    ctx.flags |= flags;
+    if (flags & MAR_FDIFF) ctx.flags &= ~MAR_FINDEX;
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.scratch = NULL;
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "encode");
+
+    lua_newtable(L);
+    ctx.arena = mar_push_arena(L); /* v, k, seen, arena */
+    enc = mar_own(L, &ctx);
+    ctx.idx = mar_encode_seen(L, &ctx);
+
+    mar_encode_buf(L, &enc->buf, &ctx);
+
+    if (ctx.flags & MAR_FLZ) {
+        lz_buffer(L, &enc->buf, &enc->code, ctx.threads);
+        lua_pushlstring(L, enc->code.data, enc->code.head);
+    }
+    else {
+        lua_pushlstring(L, enc->buf.data, enc->buf.head);
+    }
+
+    arena_release(L, ctx.arena);
+    return 1;
+}
+
+static int mar_encode(lua_State* L)
+{
+    return mar_encode_as(L, "encode", 0);
+}
+
+static int mar_encode_delta(lua_State* L)
+{
+    return mar_encode_as(L, "diff", MAR_FDIFF);
+}
+
+typedef struct mar_Stream {
+    int    func;  /* stack index of a sink function, or 0 */
+    FILE*  fp;
+    size_t total;
+} mar_Stream;
+
+static void mar_stream_write(lua_State *L, void *ud, const char *data, size_t len)
+{
+    mar_Stream *st = (mar_Stream*)ud;
+    if (st->fp) {
+        if (fwrite(data, 1, len, st->fp) != len) luaL_error(L, "write error");
+    }
+    else {
+        lua_pushvalue(L, st->func);
+        lua_pushlstring(L, data, len);
+        lua_call(L, 1, 0);
+    }
+    st->total += len;
+}
+
+/* encodes v (with k and seen below the sink) to st, returning the bytes
+ * written */
+static size_t mar_encode_stream(lua_State *L, mar_Ctx *ctx, mar_Stream *st)
+{
+    mar_LzSink lz;
+    mar_Encoder *enc, *zenc;
+
+    ctx->arena = mar_push_arena(L);
+    enc = mar_push_encoder(L, ctx);
+    buf_reserve(L, &enc->buf, MAR_CHUNK_SIZE);
+    enc->buf.sink = mar_stream_write;
+    enc->buf.sink_ud = st;
+    ctx->scratch = &enc->code;
+    ctx->objs = &enc->objs;
+    ctx->idx = mar_encode_seen(L, ctx);
+    if (ctx->flags & MAR_FLZ) {
+        /* compress each chunk as it is flushed, through a second buffer */
+        zenc = mar_push_encoder(L, ctx);
+        lz.sink = mar_stream_write;
+        lz.ud = st;
+        lz.head = MAR_HEAD_SIZE;
+        lz.out = &zenc->buf;
+        buf_reserve(L, &enc->buf, MAR_BLOCK_SIZE);
+        enc->buf.sink = lz_sink_write;
+        enc->buf.sink_ud = &lz;
+    }
+
+    mar_encode_buf(L, &enc->buf, ctx);
+    buf_flush(L, &enc->buf);
+    enc->buf.sink = NULL;
+    if (ctx->flags & MAR_FLZ) {
+        char zero = 0;
+        mar_stream_write(L, st, &zero, 1);
+    }
+    arena_release(L, ctx->arena);
+    return st->total;
+}
+
+/* encodes in the streamed format, handing the output to the sink in chunks
+ * of at most MAR_CHUNK_SIZE bytes (or one string, if that is longer) */
+static int mar_encode_to(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Stream st;
+
+    mar_check_options(L, 4, "encode_to", &ctx);
+    ctx.flags = (ctx.flags | MAR_FSTREAM) & ~MAR_FINDEX;
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    lua_settop(L, 3);
+
+    st.func = 0;
+    st.fp = NULL;
+    st.total = 0;
+    if (lua_isfunction(L, 2)) {
+        st.func = 4;
+    }
+    else {
+#if LUA_VERSION_NUM >= 502
+        luaL_Stream *p = (luaL_Stream*)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+        if (p->closef == NULL) luaL_error(L, "attempt to use a closed file");
+        st.fp = p->f;
+#else
+        FILE **fp = (FILE**)luaL_checkudata(L, 2, LUA_FILEHANDLE);
+        if (*fp == NULL) luaL_error(L, "attempt to use a closed file");
+        st.fp = *fp;
+#endif
+    }
+    lua_pushvalue(L, 2);
+    lua_remove(L, 2); /* v, k, sink */
+    mar_check_constants(L, 3, "encode_to");
+
+    lua_newtable(L);
+    lua_insert(L, SEEN_IDX); /* v, k, seen, sink */
+
+    lua_pushnumber(L, (lua_Number)mar_encode_stream(L, &ctx, &st));
+    return 1;
+}
+
+/* decodes l bytes at s, with the constants table at index 2 */
+static void mar_decode_mem(lua_State *L, const char *s, size_t l, int delta)
+{
+    mar_Decoder d;
+
+    if (l >= MAR_HEAD_SIZE && mar_is_lz(s)) {
+        mar_Decoder *z;
+        mar_Arena *a;
+        lua_newtable(L);
+        a = mar_push_arena(L);
+        z = mar_push_decoder(L, mar_decode_seen(L));
+        z->ctx.arena = a;
+        z->delta = delta;
+        lua_pushnil(L);
+        lua_insert(L, MAR_T_IDX);
+        lua_pushnil(L);
+        lua_insert(L, MAR_T_IDX); /* s, k, seen, T, K, arena, z */
+        dec_input(L, z, s, l);
+        if (!z->done) luaL_error(L, "bad code");
+        arena_release(L, a);
+        lua_rawgeti(L, SEEN_IDX, 0);
+        return;
+    }
+
+    lua_newtable(L);
+    dec_init(&d, mar_decode_seen(L));
+    lua_settop(L, MAR_K_IDX);
+
+    d.data = s;
+    d.len = l;
+    d.delta = delta;
+    if (!dec_run(L, &d)) luaL_error(L, l == 0 ? "bad header" : "bad code");
+
+    lua_rawgeti(L, SEEN_IDX, 0);
+}
+
+static int mar_decode(lua_State* L)
+{
+    size_t l;
+    const char *s = luaL_checklstring(L, 1, &l);
+
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "decode");
+    mar_decode_mem(L, s, l, 0);
+    return 1;
+}
+
+/* Decodes straight from memory the caller owns: a light userdata with an
+ * explicit length, or a full userdata, whose length defaults to its size.
+ * The memory has to stay put until decode_ptr returns. */
+static int mar_decode_ptr(lua_State *L)
+{
+    size_t l;
+    const char *s = (const char*)lua_touserdata(L, 1);
+
+    lua_Number n;
+
+    if (mar_isudata(L, 1, MAR_BUFFER)) {
+        mar_Buffer *buf = (mar_Buffer*)lua_touserdata(L, 1);
+        s = buf->data;
+        n = luaL_optnumber(L, 2, (lua_Number)buf->head);
+        luaL_argcheck(L, n >= 0 && n <= (lua_Number)buf->head, 2, "out of range");
+    }
+    else if (lua_type(L, 1) == LUA_TUSERDATA) {
+        size_t size = lua_objlen(L, 1);
+        n = luaL_optnumber(L, 2, (lua_Number)size);
+        luaL_argcheck(L, n >= 0 && n <= (lua_Number)size, 2, "out of range");
+    }
+    else {
+        luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+        n = luaL_checknumber(L, 2);
+        luaL_argcheck(L, n >= 0, 2, "out of range");
+    }
+    l = (size_t)n;
+
+    lua_settop(L, 3);
+    lua_remove(L, 2); /* ptr, k */
+    mar_check_constants(L, 3, "decode_ptr");
+    mar_decode_mem(L, s, l, 0);
+    return 1;
+}
+
+/* encode_file(path, v[, constants[, options]]): encode_to into the file at
+ * path, replacing it. The file is closed by __gc if encoding fails. */
+/* the encode of encode_file, called protected: v, k, stream, ctx */
+static int mar_encode_file_run(lua_State *L)
+{
+    mar_Stream *st = (mar_Stream*)lua_touserdata(L, 3);
+    mar_Ctx *ctx = (mar_Ctx*)lua_touserdata(L, 4);
+    lua_settop(L, 3);
+    mar_check_constants(L, 3, "encode_file");
+
+    lua_newtable(L);
+    lua_insert(L, SEEN_IDX); /* v, k, seen, stream */
+    mar_encode_stream(L, ctx, st);
+    return 0;
+}
+
+/* Encodes into path.tmp, which is renamed over path once it is complete, so
+ * a failed encode leaves the last file as it was. */
+static int mar_encode_file(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Stream st;
+    FILE **fp;
+    const char *path = luaL_checkstring(L, 1);
+    const char *tmp;
+    int status;
+
+    mar_check_options(L, 4, "encode_file", &ctx);
+    ctx.flags = (ctx.flags | MAR_FSTREAM) & ~MAR_FINDEX;
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    lua_settop(L, 3);
+    tmp = lua_pushfstring(L, "%s.tmp", path);
+
+    fp = (FILE**)lua_newuserdata(L, sizeof(FILE*));
+    *fp = NULL;
+    luaL_getmetatable(L, MAR_FILE);
+    lua_setmetatable(L, -2);
+    *fp = fopen(tmp, "wb");
+    if (!*fp) luaL_error(L, "cannot open %s: %s", tmp, strerror(errno));
+
+    st.func = 0;
+    st.fp = *fp;
+    st.total = 0;
+    lua_pushcfunction(L, mar_encode_file_run);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_pushlightuserdata(L, &st);
+    lua_pushlightuserdata(L, &ctx);
+    status = lua_pcall(L, 4, 0, 0);
+    *fp = NULL;
+    if (fclose(st.fp) != 0 && status == 0) {
+        lua_pushliteral(L, "write error");
+        status = -1;
+    }
+    if (status == 0 && rename(tmp, path) != 0) {
+        lua_pushfstring(L, "cannot rename %s: %s", tmp, strerror(errno));
+        status = -1;
+    }
+    if (status != 0) {
+        remove(tmp);
+        lua_error(L);
+    }
+
+    lua_pushnumber(L, (lua_Number)st.total);
+    return 1;
+}
+
+static int mar_file_gc(lua_State *L)
+{
+    FILE **fp = (FILE**)luaL_checkudata(L, 1, MAR_FILE);
+    if (*fp) fclose(*fp);
+    *fp = NULL;
+    return 0;
+}
+
+/* The contents of a file for decode_file: mapped, or read into memory
+ * where mapping isn't available. __gc gives it back if decoding fails. */
+typedef struct mar_Map {
+    char  *data;
+    size_t len;
+} mar_Map;
+
+static void map_open(lua_State *L, mar_Map *m, const char *path)
+{
+#ifdef MAR_MMAP
+    struct stat sb;
+    void *p;
+    int err, fd = open(path, O_RDONLY);
+    if (fd < 0) luaL_error(L, "cannot open %s: %s", path, strerror(errno));
+    if (fstat(fd, &sb) != 0) {
+        err = errno;
+        close(fd);
+        luaL_error(L, "cannot read %s: %s", path, strerror(err));
+    }
+    if ((off_t)(size_t)sb.st_size != sb.st_size) {
+        close(fd);
+        luaL_error(L, "%s is too large to map", path);
+    }
+    if (sb.st_size == 0) {
+        close(fd);
+        return;
+    }
+    p = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    err = errno;
+    close(fd);
+    if (p == MAP_FAILED) luaL_error(L, "cannot map %s: %s", path, strerror(err));
+    m->data = (char*)p;
+    m->len = (size_t)sb.st_size;
+#else
+    long n;
+    FILE *fp = fopen(path, "rb");
+    if (!fp) luaL_error(L, "cannot open %s: %s", path, strerror(errno));
+    if (fseek(fp, 0, SEEK_END) != 0 || (n = ftell(fp)) < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+        fclose(fp);
+        luaL_error(L, "cannot read %s", path);
+    }
+    if (n > 0) {
+        m->data = (char*)mar_lalloc(L, NULL, 0, (size_t)n);
+        m->len = (size_t)n;
+        if (fread(m->data, 1, m->len, fp) != m->len) {
+            fclose(fp);
+            luaL_error(L, "cannot read %s", path);
+        }
+    }
+    fclose(fp);
+#endif
+}
+
+static void map_close(lua_State *L, mar_Map *m)
+{
+    if (!m->data) return;
+#ifdef MAR_MMAP
+    munmap(m->data, m->len);
+#else
+    mar_lalloc(L, m->data, m->len, 0);
+#endif
+    m->data = NULL;
+}
+
+static int mar_map_gc(lua_State *L)
+{
+    map_close(L, (mar_Map*)luaL_checkudata(L, 1, MAR_MAP));
+    return 0;
+}
+
+/* decode_file(path[, constants]): decodes the file straight out of its
+ * mapping, which is only read during the call */
+static int mar_decode_file(lua_State *L)
+{
+    mar_Map *m;
+    const char *path = luaL_checkstring(L, 1);
+
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "decode_file");
+    m = (mar_Map*)lua_newuserdata(L, sizeof(mar_Map));
+    m->data = NULL;
+    m->len = 0;
+    luaL_getmetatable(L, MAR_MAP);
+    lua_setmetatable(L, -2);
+    map_open(L, m, path);
+    lua_replace(L, 1); /* map, k */
+
+    mar_decode_mem(L, m->data ? m->data : "", m->len, 0);
+    map_close(L, m);
+    return 1;
+}
+
+/* clone walks the value with an explicit stack as well. The source of the
+ * top copy sits in the slot after the work table w, then the copy, the last
+ * key (or the __persist callback) and the copied key. Opening copy d saves
+ * the parent's four slots in the work table at 4d+1..4d+4. For a __persist
+ * object the copy slot holds the copied callback. */
+typedef struct mar_Copy {
+    int kind;   /* MAR_KTABLE, MAR_KUPVALS or MAR_KPERSIST */
+    int state;  /* MAR_SKEY or MAR_SVAL while a table entry is copied */
+    int i;      /* upvalue being copied */
+    int n;
+} mar_Copy;
+
+typedef struct mar_CopyStack {
+    int    w;
+    size_t depth;
+    size_t ncopies;
+    mar_Copy *copies;
+    mar_Copy inline_copies[MAR_FRAMES];
+} mar_CopyStack;
+
+/* opens a copy of the source below the copy on top, popping both */
+static void mar_clone_open(lua_State *L, mar_CopyStack *st, int kind)
+{
+    mar_Copy *c;
+    int i;
+    if (st->depth == st->ncopies) {
+        mar_Copy *copies;
+        if (st->ncopies > ((size_t)-1 / 2) / sizeof(mar_Copy)) {
+            luaL_error(L, "nesting too deep");
+        }
+        copies = (mar_Copy*)lua_newuserdata(L, 2 * st->ncopies * sizeof(mar_Copy));
+        memcpy(copies, st->copies, st->ncopies * sizeof(mar_Copy));
+        lua_rawseti(L, st->w, 0);
+        st->copies = copies;
+        st->ncopies *= 2;
+    }
+    for (i = 1; i <= 4; i++) {
+        lua_pushvalue(L, st->w + i);
+        lua_rawseti(L, st->w, 4 * (int)st->depth + i);
+    }
+    c = &st->copies[st->depth++];
+    c->kind = kind;
+    c->state = MAR_SKEY;
+    c->i = 0;
+    c->n = 0;
+    lua_replace(L, st->w + 2);
+    lua_replace(L, st->w + 1);
+    lua_pushnil(L);
+    lua_replace(L, st->w + 3);
+    lua_pushnil(L);
+    lua_replace(L, st->w + 4);
+}
+
+/* Replaces the value on top with its copy and returns true, or opens a copy
+ * for its contents and returns false. Follows the same rules as encode
+ * followed by decode: strings, numbers and booleans are returned as they
+ * are, constants and values seen before map to the same copy, __persist
+ * closures are copied and then called. Lua functions without upvalues have
+ * no state to copy and are shared. */
+static int mar_clone_item(lua_State *L, mar_Ctx *ctx, mar_CopyStack *st)
+{
+    int val_type = lua_type(L, -1);
+
+    switch (val_type) {
+    case LUA_TNIL:
+    case LUA_TBOOLEAN:
+    case LUA_TNUMBER:
+    case LUA_TSTRING:
+        return 1;
+    case LUA_TTABLE:
+    case LUA_TFUNCTION:
+    case LUA_TUSERDATA:
+        break;
+    default:
+        luaL_error(L, "invalid value type (%s)", lua_typename(L, val_type));
+    }
+
+    lua_pushvalue(L, -1);
+    lua_rawget(L, SEEN_IDX);
+    if (lua_touserdata(L, -1) == (void*)&mar_persist_key) {
+        lua_pop(L, 2);
+        lua_pushnil(L);
+        return 1;
+    }
+    if (!lua_isnil(L, -1)) {
+        lua_remove(L, -2);
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    if (val_type == LUA_TUSERDATA && mar_hook(L, -1)) {
+        const mar_Hook *hook = mar_hook(L, -1);
+        mar_Buffer *raw = mar_scratch(L, ctx);
+        buf_reserve(L, raw, hook->size);
+        hook->write(L, lua_gettop(L), raw->data);
+        hook->read(L, raw->data);
+    }
+    else if (val_type != LUA_TFUNCTION && luaL_getmetafield(L, -1, "__persist")) {
+        lua_pushvalue(L, -2);
+        lua_call(L, 1, 1);
+        if (!lua_isfunction(L, -1)) {
+            luaL_error(L, "__persist must return a function");
+        }
+        /* until the callback is copied and called, the object copies to
+         * nil, as decode has nothing for it either */
+        lua_pushvalue(L, -2);
+        lua_pushlightuserdata(L, (void*)&mar_persist_key);
+        lua_rawset(L, SEEN_IDX);
+        lua_insert(L, -2);
+        lua_pushnil(L); /* callback, obj, no copy yet */
+        mar_clone_open(L, st, MAR_KPERSIST);
+        lua_replace(L, st->w + 3);
+        return 0;
+    }
+    else if (val_type == LUA_TTABLE) {
+        lua_createtable(L, lua_objlen(L, -1), 0);
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, SEEN_IDX);
+        mar_clone_open(L, st, MAR_KTABLE);
+        return 0;
+    }
+    else if (val_type == LUA_TFUNCTION) {
+        lua_Debug ar;
+        mar_Buffer *buf;
+
+        lua_pushvalue(L, -1);
+        lua_getinfo(L, ">nuS", &ar);
+        if (ar.what[0] != 'L') {
+            luaL_error(L, "attempt to persist a C function '%s'", ar.name);
+        }
+        if (ar.nups == 0) {
+            lua_pushvalue(L, -1);
+            lua_pushvalue(L, -1);
+            lua_rawset(L, SEEN_IDX);
+            return 1;
+        }
+
+        buf = mar_scratch(L, ctx);
+        mar_dump(L, (lua_Writer)buf_write, buf);
+        mar_load(L, buf->data, buf->head);
+        lua_pushvalue(L, -2);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, SEEN_IDX);
+        mar_clone_open(L, st, MAR_KUPVALS);
+        st->copies[st->depth - 1].n = ar.nups;
+        return 0;
+    }
+    else {
+        luaL_error(L, "attempt to clone userdata (no __persist hook)");
+    }
+    lua_pushvalue(L, -2);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, SEEN_IDX);
+    lua_remove(L, -2);
+    return 1;
+}
+
+/* pushes the next value of the top copy to be copied, or returns false */
+static int mar_clone_next(lua_State *L, mar_CopyStack *st)
+{
+    mar_Copy *c = &st->copies[st->depth - 1];
+    switch (c->kind) {
+    case MAR_KTABLE:
+        lua_pushvalue(L, st->w + 3);
+        if (c->state == MAR_SVAL) {
+            lua_rawget(L, st->w + 1);
+            return 1;
+        }
+        if (!lua_next(L, st->w + 1)) return 0;
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_replace(L, st->w + 3);
+        return 1;
+    case MAR_KUPVALS:
+        while (++c->i <= c->n) {
+            if (!mar_is_env(L, lua_getupvalue(L, st->w + 1, c->i))) return 1;
+            lua_pop(L, 1);
+        }
+        return 0;
+    default:
+        if (c->i++) return 0;
+        lua_pushvalue(L, st->w + 3);
+        return 1;
+    }
+}
+
+/* hands the copy on top to the top copy */
+static void mar_clone_deliver(lua_State *L, mar_CopyStack *st)
+{
+    mar_Copy *c = &st->copies[st->depth - 1];
+    switch (c->kind) {
+    case MAR_KTABLE:
+        if (c->state == MAR_SKEY) {
+            lua_replace(L, st->w + 4);
+            c->state = MAR_SVAL;
+        }
+        else {
+            lua_pushvalue(L, st->w + 4);
+            lua_insert(L, -2);
+            lua_rawset(L, st->w + 2);
+            c->state = MAR_SKEY;
+        }
+        break;
+    case MAR_KUPVALS:
+        lua_setupvalue(L, st->w + 2, c->i);
+        break;
+    default:
+        lua_replace(L, st->w + 2);
+    }
+}
+
+/* finishes the top copy, pushing it */
+static void mar_clone_close(lua_State *L, mar_CopyStack *st)
+{
+    mar_Copy *c = &st->copies[--st->depth];
+    int i;
+    if (c->kind == MAR_KPERSIST) {
+        lua_pushvalue(L, st->w + 2);
+        lua_call(L, 0, 1);
+        lua_pushvalue(L, st->w + 1);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, SEEN_IDX);
+    }
+    else {
+        lua_pushvalue(L, st->w + 2);
+    }
+    for (i = 1; i <= 4; i++) {
+        lua_rawgeti(L, st->w, 4 * (int)st->depth + i);
+        lua_replace(L, st->w + i);
+    }
+}
+
+/* pushes a copy of the value at val */
+static void mar_clone_value(lua_State *L, int val, mar_Ctx *ctx)
+{
+    mar_CopyStack st;
+    int i, done;
+    lua_newtable(L);
+    st.w = lua_gettop(L);
+    for (i = 1; i <= 4; i++) lua_pushnil(L);
+    st.depth = 0;
+    st.ncopies = MAR_FRAMES;
+    st.copies = st.inline_copies;
+
+    lua_pushvalue(L, val);
+    for (;;) {
+        done = mar_clone_item(L, ctx, &st);
+        while (done || !mar_clone_next(L, &st)) {
+            if (!done) mar_clone_close(L, &st);
+            if (st.depth == 0) {
+                lua_replace(L, st.w);
+                lua_settop(L, st.w);
+                return;
+            }
+            mar_clone_deliver(L, &st);
+            done = 0;
+        }
+    }
+}
+
+static int mar_clone(lua_State* L)
+{
+    size_t i, len;
+    mar_Ctx ctx;
+
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "clone");
+    ctx.idx = 0;
+    ctx.flags = 0;
+    ctx.strmin = 0;
+    ctx.threads = 1;
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.scratch = NULL;
+    ctx.objs = NULL;
+    ctx.consts = NULL;
+    ctx.arena = NULL;
+
+    mar_constants_list(L);
+    len = lua_objlen(L, 2);
+    lua_newtable(L);
+    for (i = 1; i <= len; i++) {
+        lua_rawgeti(L, 2, i);
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            continue;
+        }
+        lua_pushvalue(L, -1);
+        lua_rawset(L, SEEN_IDX);
+    }
+
+    mar_clone_value(L, 1, &ctx);
+    return 1;
+}
+
+static int mar_encoder(lua_State *L)
+{
+    mar_Ctx opts;
+    mar_check_options(L, 1, "encoder", &opts);
+    mar_push_encoder(L, &opts);
+    return 1;
+}
+
+static int mar_encoder_encode(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Encoder *enc = (mar_Encoder*)luaL_checkudata(L, 1, MAR_ENCODER);
+
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+    lua_remove(L, 1); /* v, k, self */
+    mar_check_constants(L, 3, "encode");
+
+    lua_getfenv(L, 3);
+    lua_insert(L, SEEN_IDX); /* v, k, seen, self */
+    if (enc->dirty) {
+        mar_clear_table(L, SEEN_IDX);
+    }
+    enc->dirty = 1;
+    seen_clear(L, &enc->objs);
+    ctx = enc->opts;
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.scratch = &enc->code;
+    ctx.objs = &enc->objs;
+    ctx.idx = mar_encode_seen(L, &ctx);
+
+    enc->buf.head = 0;
+    enc->buf.seek = 0;
+    mar_encode_buf(L, &enc->buf, &ctx);
+
+    if (ctx.flags & MAR_FLZ) {
+        lz_buffer(L, &enc->buf, &enc->code, ctx.threads);
+        lua_pushlstring(L, enc->code.data, enc->code.head);
+    }
+    else {
+        lua_pushlstring(L, enc->buf.data, enc->buf.head);
+    }
+
+    mar_clear_table(L, SEEN_IDX);
+    enc->dirty = 0;
+
+    return 1;
+}
+
+static int mar_encoder_gc(lua_State *L)
+{
+    mar_Encoder *enc = (mar_Encoder*)luaL_checkudata(L, 1, MAR_ENCODER);
+    if (enc->buf.data) {
+        buf_done(L, &enc->buf);
+        enc->buf.data = NULL;
+    }
+    if (enc->code.data) {
+        buf_done(L, &enc->code);
+        enc->code.data = NULL;
+    }
+    seen_free(L, &enc->objs);
+    enc->objs.slots = NULL;
+    return 0;
+}
+
+static int mar_decoder(lua_State *L)
+{
+    lua_settop(L, 1);
+    lua_pushnil(L);
+    lua_insert(L, 1); /* nil, k */
+    mar_check_constants(L, 1, "decoder");
+    lua_newtable(L);
+    mar_push_decoder(L, mar_decode_seen(L));
+    lua_pushvalue(L, SEEN_IDX);
+    lua_setfenv(L, -2);
+    return 1;
+}
+
+/* Appends a chunk of input and decodes as much of it as possible. The
+ * consumed part of the buffer is only dropped once it is at least half of
+ * it, so a large token arriving in small chunks is not moved over and over
+ * (see dec_space). */
+static int mar_decoder_feed(lua_State *L)
+{
+    size_t l;
+    mar_Decoder *d = (mar_Decoder*)luaL_checkudata(L, 1, MAR_DECODER);
+    const char *s = luaL_checklstring(L, 2, &l);
+    int depth = (int)d->depth;
+
+    if (d->failed) luaL_error(L, "decoder failed earlier");
+    if (d->done) {
+        /* all that may follow the value is its index */
+        if (!(d->ctx.flags & MAR_FINDEX)) luaL_error(L, "value already decoded");
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    lua_settop(L, 2);
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, SEEN_IDX, -2 * depth - 1);
+    lua_rawgeti(L, SEEN_IDX, -2 * depth - 2);
+
+    d->failed = 1;
+    dec_input(L, d, s, l);
+    d->failed = 0;
+
+    depth = (int)d->depth;
+    lua_pushvalue(L, MAR_T_IDX);
+    lua_rawseti(L, SEEN_IDX, -2 * depth - 1);
+    lua_pushvalue(L, MAR_K_IDX);
+    lua_rawseti(L, SEEN_IDX, -2 * depth - 2);
+
+    lua_pushboolean(L, d->done);
+    return 1;
+}
+
+static int mar_decoder_result(lua_State *L)
+{
+    mar_Decoder *d = (mar_Decoder*)luaL_checkudata(L, 1, MAR_DECODER);
+    if (!d->done) luaL_error(L, "incomplete value");
+    lua_getfenv(L, 1);
+    lua_rawgeti(L, -1, 0);
+    return 1;
+}
+
+static int mar_decoder_gc(lua_State *L)
+{
+    mar_Decoder *d = (mar_Decoder*)luaL_checkudata(L, 1, MAR_DECODER);
+    if (d->in.data) {
+        buf_done(L, &d->in);
+        d->in.data = NULL;
+    }
+    if (d->z.data) {
+        buf_done(L, &d->z);
+        d->z.data = NULL;
+    }
+    return 0;
+}
+
+/* Views
+ *
+ * A view decodes a table only when it is first touched. Opening a view
+ * scans the input once to find where each table and interned string
+ * starts, in seen order, so that refs resolve without decoding what comes
+ * before them. A table is a proxy (an empty table with the view metatable)
+ * until it is indexed; then its own entries are decoded into it, with
+ * nested tables becoming proxies in turn and their bodies skipped by
+ * length, and the metatable is removed.
+ *
+ * The view's env holds the input (1), the constants (2), the proxies by
+ * seen index (3), the seen index of each proxy (4) and the metatable (5). */
+static void view_add(lua_State *L, mar_View *v, size_t offset)
+{
+    if (v->n == v->cap) {
+        size_t cap = v->cap ? 2 * v->cap : 64;
+        size_t *offs;
+        if (cap > (size_t)-1 / sizeof(size_t)) luaL_error(L, "Out of memory!");
+        offs = (size_t*)mar_lalloc(L, v->offs, v->cap * sizeof(size_t), cap * sizeof(size_t));
+        v->offs = offs;
+        v->cap = cap;
+    }
+    v->offs[v->n++] = offset;
+}
+
+#define view_need(c) if (!(c)) luaL_error(L, "bad code");
+
+/* false if the input holds something a view can't defer */
+static int view_scan(lua_State *L, mar_View *v, mar_Decoder *d)
+{
+    size_t l;
+    while (d->pos < d->len) {
+        size_t offset = d->pos;
+        char tag;
+        switch ((unsigned char)d->data[d->pos++]) {
+        case LUA_TNIL:
+        case LUA_TTHREAD:
+            break;
+        case LUA_TBOOLEAN:
+            view_need(dec_avail(d) >= MAR_CHR);
+            d->pos += MAR_CHR;
+            break;
+        case LUA_TNUMBER:
+            view_need(dec_avail(d) >= MAR_I64);
+            d->pos += MAR_I64;
+            break;
+        case MAR_TINT: {
+            uint64_t zz;
+            view_need(dec_var(L, d, &zz));
+            break;
+        }
+        case MAR_TSTR:
+            view_add(L, v, offset);
+            /* fall through */
+        case LUA_TSTRING:
+            view_need(dec_size(L, d, &l) && dec_avail(d) >= l);
+            d->pos += l;
+            break;
+        case MAR_TSRF:
+            view_need(dec_size(L, d, &l));
+            break;
+        case LUA_TTABLE:
+        case LUA_TUSERDATA:
+            view_need(d->pos < d->len);
+            tag = d->data[d->pos++];
+            if (tag == MAR_TREF) {
+                view_need(dec_size(L, d, &l));
+            }
+            else if (tag == MAR_TVAL && d->data[offset] == LUA_TTABLE) {
+                view_add(L, v, offset);
+                view_need(dec_size(L, d, &l) && dec_size(L, d, &l) && dec_size(L, d, &l));
+            }
+            else if (tag == MAR_TPKD && d->data[offset] == LUA_TTABLE) {
+                view_add(L, v, offset);
+                view_need(dec_size(L, d, &l) && dec_avail(d) >= l);
+                d->pos += l;
+            }
+            else if (tag != MAR_TVAL) {
+                return 0;
+            }
+            break;
+        case LUA_TFUNCTION:
+            return 0;
+        default:
+            luaL_error(L, "bad code");
+        }
+    }
+    return 1;
+}
+
+/* seen index of the table whose type byte is at offset */
+static size_t view_find(lua_State *L, mar_View *v, size_t offset)
+{
+    size_t lo = 0, hi = v->n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (v->offs[mid] < offset) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == v->n || v->offs[lo] != offset) luaL_error(L, "bad code");
+    return v->base + lo;
+}
+
+static void view_read(lua_State *L, mar_View *v, int e, mar_Decoder *d);
+
+/* pushes the object with seen index idx, making a proxy for a table */
+static void view_object(lua_State *L, mar_View *v, int e, size_t idx)
+{
+    size_t offset;
+    if (idx < v->base) {
+        lua_rawgeti(L, e, 2);
+        lua_rawgeti(L, -1, idx);
+        lua_remove(L, -2);
+        return;
+    }
+    if (idx - v->base >= v->n) luaL_error(L, "bad code");
+    offset = v->offs[idx - v->base];
+    if (v->data[offset] == MAR_TSTR) {
+        mar_Decoder d;
+        dec_init(&d, 0);
+        d.ctx.flags = v->flags;
+        d.data = v->data;
+        d.len = v->len;
+        d.pos = offset;
+        view_read(L, v, e, &d);
+        return;
+    }
+    lua_rawgeti(L, e, 3);
+    lua_rawgeti(L, -1, idx);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_rawgeti(L, e, 5);
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -3, idx);
+        lua_rawgeti(L, e, 4);
+        lua_pushvalue(L, -2);
+        lua_pushinteger(L, idx);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    lua_remove(L, -2);
+}
+
+static void view_read(lua_State *L, mar_View *v, int e, mar_Decoder *d)
+{
+    size_t offset = d->pos, l;
+    uint64_t zz = 0;
+    view_need(d->pos < d->len);
+    switch ((unsigned char)d->data[d->pos++]) {
+    case LUA_TNIL:
+    case LUA_TTHREAD:
+        lua_pushnil(L);
+        break;
+    case LUA_TBOOLEAN:
+        view_need(dec_avail(d) >= MAR_CHR);
+        lua_pushboolean(L, d->data[d->pos++]);
+        break;
+    case LUA_TNUMBER:
+        view_need(dec_avail(d) >= MAR_I64);
+        lua_pushnumber(L, mar_get_num(d->data + d->pos));
+        d->pos += MAR_I64;
+        break;
+    case MAR_TINT:
+        view_need(dec_var(L, d, &zz));
+        mar_pushint(L, mar_unzigzag(zz));
+        break;
+    case LUA_TSTRING:
+    case MAR_TSTR:
+        view_need(dec_size(L, d, &l) && dec_avail(d) >= l);
+        lua_pushlstring(L, d->data + d->pos, l);
+        d->pos += l;
+        break;
+    case MAR_TSRF:
+        view_need(dec_size(L, d, &l));
+        view_object(L, v, e, l);
+        break;
+    case LUA_TTABLE:
+    case LUA_TUSERDATA:
+        view_need(d->pos < d->len);
+        if (d->data[d->pos++] == MAR_TREF) {
+            view_need(dec_size(L, d, &l));
+            view_object(L, v, e, l);
+        }
+        else if (d->data[offset] == LUA_TTABLE) {
+            view_object(L, v, e, view_find(L, v, offset));
+            view_need(dec_size(L, d, &l) && dec_avail(d) >= l);
+            d->pos += l;
+        }
+        else {
+            lua_pushnil(L);
+        }
+        break;
+    default:
+        luaL_error(L, "bad code");
+    }
+}
+
+/* decodes the entries of the proxy at p into it */
+static void view_fill(lua_State *L, int p)
+{
+    mar_View *v;
+    mar_Decoder d;
+    size_t idx, l, narr, nrec, i;
+    int e, top = lua_gettop(L);
+
+    lua_getmetatable(L, p);
+    lua_pushlightuserdata(L, (void*)&mar_view_key);
+    lua_rawget(L, -2);
+    v = (mar_View*)lua_touserdata(L, -1);
+    lua_getfenv(L, -1);
+    e = lua_gettop(L);
+    lua_rawgeti(L, e, 4);
+    lua_pushvalue(L, p);
+    lua_rawget(L, -2);
+    idx = (size_t)lua_tointeger(L, -1);
+    lua_pushnil(L);
+    lua_setmetatable(L, p);
+
+    dec_init(&d, 0);
+    d.ctx.flags = v->flags;
+    d.data = v->data;
+    d.len = v->len;
+    d.pos = v->offs[idx - v->base] + 2;
+    if (d.data[d.pos - 1] == MAR_TPKD) {
+        view_need(dec_size(L, &d, &l) && dec_avail(&d) >= l);
+        dec_packed(L, &d, d.pos + l, p);
+        lua_settop(L, top);
+        return;
+    }
+    view_need(dec_size(L, &d, &l) && dec_size(L, &d, &narr) && dec_size(L, &d, &nrec));
+    if (narr > l || nrec > l / 2) luaL_error(L, "bad code");
+    for (i = 1; i <= narr; i++) {
+        view_read(L, v, e, &d);
+        lua_rawseti(L, p, i);
+    }
+    for (i = 0; i < nrec; i++) {
+        view_read(L, v, e, &d);
+        view_read(L, v, e, &d);
+        lua_rawset(L, p);
+    }
+    lua_settop(L, top);
+}
+
+static int mar_view_index(lua_State *L)
+{
+    lua_settop(L, 2);
+    view_fill(L, 1);
+    lua_rawget(L, 1);
+    return 1;
+}
+
+static int mar_view_newindex(lua_State *L)
+{
+    lua_settop(L, 3);
+    view_fill(L, 1);
+    lua_rawset(L, 1);
+    return 0;
+}
+
+static int mar_arena_gc(lua_State *L)
+{
+    arena_release(L, (mar_Arena*)lua_touserdata(L, 1));
+    return 0;
+}
+
+static int mar_view_gc(lua_State *L)
+{
+    mar_View *v = (mar_View*)luaL_checkudata(L, 1, MAR_VIEW);
+    if (v->offs) mar_lalloc(L, v->offs, v->cap * sizeof(size_t), 0);
+    v->offs = NULL;
+    return 0;
+}
+
+/* Unless the input holds functions, __persist objects, shapes or the
+ * streamed framing, returns the value with its tables as proxies. Otherwise it
+ * decodes the whole value like decode does. */
+static int mar_view(lua_State *L)
+{
+    size_t l;
+    mar_View *v;
+    mar_Decoder d;
+    const char *s = luaL_checklstring(L, 1, &l);
+
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "view");
+    mar_constants_list(L);
+    if (l >= MAR_HEAD_SIZE && mar_is_lz(s)) {
+        s = mar_inflate(L, s, l, &l);
+        lua_replace(L, 1);
+    }
+
+    v = (mar_View*)lua_newuserdata(L, sizeof(mar_View));
+    v->data = s;
+    v->len = l;
+    v->base = lua_objlen(L, 2) + 1;
+    v->n = 0;
+    v->cap = 0;
+    v->offs = NULL;
+    luaL_getmetatable(L, MAR_VIEW);
+    lua_setmetatable(L, -2);
+
+    dec_init(&d, 0);
+    d.data = s;
+    d.len = l;
+    if (!dec_magic(L, &d)) luaL_error(L, l == 0 ? "bad header" : "bad code");
+    v->flags = d.ctx.flags;
+    v->start = d.pos;
+    if (v->flags & MAR_FINDEX) {
+        d.len = v->len = mar_index_foot(L, s, l);
+    }
+    if ((v->flags & MAR_FSTREAM) || !view_scan(L, v, &d)) {
+        lua_settop(L, 2);
+        mar_decode_mem(L, s, l, 0);
+        return 1;
+    }
+
+    lua_createtable(L, 5, 0);
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, -2, 1);
+    lua_pushvalue(L, 2);
+    lua_rawseti(L, -2, 2);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 3);
+    lua_newtable(L);
+    lua_rawseti(L, -2, 4);
+    lua_createtable(L, 0, 3);
+    lua_pushcfunction(L, mar_view_index);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mar_view_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushlightuserdata(L, (void*)&mar_view_key);
+    lua_pushvalue(L, 3);
+    lua_rawset(L, -3);
+    lua_rawseti(L, -2, 5);
+    lua_setfenv(L, 3);
+
+    lua_getfenv(L, 3);
+    d.pos = v->start;
+    view_read(L, v, 4, &d);
+    return 1;
+}
+
+/* fills a proxy from a view in place, so that pairs and # see its entries */
+static int mar_fill(lua_State *L)
+{
+    lua_settop(L, 1);
+    if (lua_istable(L, 1) && lua_getmetatable(L, 1)) {
+        lua_pushlightuserdata(L, (void*)&mar_view_key);
+        lua_rawget(L, -2);
+        if (lua_isuserdata(L, -1)) view_fill(L, 1);
+        lua_settop(L, 1);
+    }
+    return 1;
+}
+
+/* Looks the key at index 1 up in the index and decodes its value by itself.
+ * Returns 1 with the value pushed, or 0 if the index can't help: the root
+ * isn't a table, or the value refers to something written before it. */
+static int mar_get_indexed(lua_State *L, mar_Decoder *d, const char *s, size_t l)
+{
+    char kn[MAR_I64];
+    const char *kp;
+    size_t kl, foot, nslots, i, n;
+    uint32_t h, v, e[4];
+    int found = 0, ktype = mar_index_key(L, 1, kn, &kp, &kl);
+
+    if (!ktype) return 0;
+    foot = mar_index_foot(L, s, l);
+    nslots = mar_get32(s + foot);
+    if (nslots > (l - foot - 2 * MAR_I32) / MAR_I32) luaL_error(L, "bad code");
+    if (nslots == 0) return 0;
+
+    h = mar_hash(ktype, kp, kl);
+    for (n = 0, i = h & (nslots - 1); n < nslots; n++, i = (i + 1) & (nslots - 1)) {
+        size_t entry, p;
+        v = mar_get32(s + foot + MAR_I32 * (1 + i));
+        if (v == 0) break;
+        entry = foot + v;
+        if (entry > l - MAR_I32 || l - MAR_I32 - entry < MAR_I32 + MAR_CHR) {
+            luaL_error(L, "bad code");
+        }
+        v = mar_get32(s + entry);
+        if (v != h || s[entry + MAR_I32] != ktype) continue;
+        p = entry + MAR_I32 + MAR_CHR;
+        if (ktype == LUA_TSTRING) {
+            if (l - MAR_I32 - p < MAR_I32) luaL_error(L, "bad code");
+            v = mar_get32(s + p);
+            p += MAR_I32;
+            if (v != kl) continue;
+        }
+        if (l - MAR_I32 - p < kl + sizeof(e)) luaL_error(L, "bad code");
+        if (memcmp(s + p, kp, kl) != 0) continue;
+        for (v = 0; v < 4; v++) e[v] = mar_get32(s + p + kl + MAR_I32 * v);
+        found = 1;
+        break;
+    }
+    if (!found) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    /* offsets are from the first entry of the root table */
+    d->len = foot;
+    if (dec_avail(d) < 2 || d->data[d->pos] != LUA_TTABLE
+        || d->data[d->pos + 1] != MAR_TVAL) {
+        return 0;
+    }
+    d->pos += 2;
+    if (!dec_size(L, d, &kl) || !dec_size(L, d, &kl) || !dec_size(L, d, &kl)) {
+        luaL_error(L, "bad code");
+    }
+    if (e[0] >= dec_avail(d)) luaL_error(L, "bad code");
+    d->pos += e[0];
+    d->lo = d->ctx.idx;
+    d->hi = e[1];
+    d->ctx.idx = e[1];
+    d->ctx.nprotos = e[2];
+    d->plim = e[2];
+    d->ctx.nshapes = e[3];
+    d->slim = e[3];
+    if (dec_run(L, d)) {
+        lua_rawgeti(L, SEEN_IDX, 0);
+        return 1;
+    }
+    if (!d->outside) luaL_error(L, "bad code");
+    return 0;
+}
+
+/* Decodes t[key] from an encoded table, reading only that value when the
+ * input has an index. Without an index, or when the value can't be read on
+ * its own, it decodes the whole table. */
+static int mar_get(lua_State *L)
+{
+    mar_Decoder d;
+    size_t l, idx;
+    const char *s = luaL_checklstring(L, 1, &l);
+
+    luaL_checkany(L, 2);
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+    lua_remove(L, 1); /* key, k, s */
+    mar_check_constants(L, 3, "get");
+    lua_newtable(L);
+    lua_insert(L, SEEN_IDX);
+    idx = mar_decode_seen(L);
+    lua_pushnil(L);
+    lua_insert(L, MAR_T_IDX);
+    lua_pushnil(L);
+    lua_insert(L, MAR_T_IDX); /* key, k, seen, T, K, s */
+    if (l >= MAR_HEAD_SIZE && mar_is_lz(s)) {
+        s = mar_inflate(L, s, l, &l);
+        lua_replace(L, 6);
+    }
+
+    dec_init(&d, idx);
+    d.data = s;
+    d.len = l;
+    if (!dec_magic(L, &d)) luaL_error(L, l == 0 ? "bad header" : "bad code");
+    if ((d.ctx.flags & MAR_FINDEX) && mar_get_indexed(L, &d, s, l)) {
+        return 1;
+    }
+
+    dec_init(&d, idx);
+    d.data = s;
+    d.len = l;
+    if (!dec_run(L, &d)) luaL_error(L, "bad code");
+    lua_rawgeti(L, SEEN_IDX, 0);
+    if (!lua_istable(L, -1)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_pushvalue(L, 1);
+    lua_rawget(L, -2);
+    return 1;
+}
+
+/* A byte buffer which encode_into writes to, so that the output can be
+ * handed to C (through its pointer and length) without becoming a string. */
+static int mar_buffer(lua_State *L)
+{
+    lua_Number size = luaL_optnumber(L, 1, 0);
+    mar_Buffer *buf = (mar_Buffer*)lua_newuserdata(L, sizeof(mar_Buffer));
+    buf->data = NULL;
+    luaL_getmetatable(L, MAR_BUFFER);
+    lua_setmetatable(L, -2);
+    buf_init(L, buf, NULL);
+    if (size > 0) buf_reserve(L, buf, (size_t)size);
+    return 1;
+}
+
+static int mar_buffer_ptr(lua_State *L)
+{
+    mar_Buffer *buf = (mar_Buffer*)luaL_checkudata(L, 1, MAR_BUFFER);
+    lua_pushlightuserdata(L, buf->data);
+    return 1;
+}
+
+static int mar_buffer_len(lua_State *L)
+{
+    mar_Buffer *buf = (mar_Buffer*)luaL_checkudata(L, 1, MAR_BUFFER);
+    lua_pushnumber(L, (lua_Number)buf->head);
+    return 1;
+}
+
+static int mar_buffer_string(lua_State *L)
+{
+    mar_Buffer *buf = (mar_Buffer*)luaL_checkudata(L, 1, MAR_BUFFER);
+    lua_pushlstring(L, buf->data, buf->head);
+    return 1;
+}
+
+static int mar_buffer_gc(lua_State *L)
+{
+    mar_Buffer *buf = (mar_Buffer*)luaL_checkudata(L, 1, MAR_BUFFER);
+    if (buf->data) {
+        buf_done(L, buf);
+        buf->data = NULL;
+    }
+    return 0;
+}
+
+/* encodes into a buffer, replacing what it held, and returns the length */
+static int mar_encode_into(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Buffer *buf = (mar_Buffer*)luaL_checkudata(L, 1, MAR_BUFFER);
+
+    mar_check_options(L, 4, "encode_into", &ctx);
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.scratch = NULL;
+    lua_settop(L, 3);
+    lua_pushvalue(L, 1);
+    lua_remove(L, 1); /* v, k, buf */
+    mar_check_constants(L, 3, "encode_into");
+
+    lua_newtable(L);
+    lua_insert(L, SEEN_IDX); /* v, k, seen, buf */
+    ctx.idx = mar_encode_seen(L, &ctx);
+
+    buf->head = 0;
+    buf->seek = 0;
+    mar_encode_buf(L, buf, &ctx);
+    if (ctx.flags & MAR_FLZ) {
+        mar_Encoder *z = mar_push_encoder(L, &ctx);
+        mar_Buffer tmp = *buf;
+        lz_buffer(L, buf, &z->buf, ctx.threads);
+        *buf = z->buf;
+        z->buf = tmp;
+    }
+
+    lua_pushnumber(L, (lua_Number)buf->head);
+    return 1;
+}
+
+#ifdef MAR_STATS
+/* stats([reset]) returns the counts since the last reset as a table */
+static int mar_stats_get(lua_State *L)
+{
+    int i;
+    lua_newtable(L);
+#define mar_stat_field(name) \
+    (mar_pushint(L, mar_stats.name), lua_setfield(L, -2, #name))
+    mar_stat_field(encodes);
+    mar_stat_field(tables);
+    mar_stat_field(functions);
+    mar_stat_field(persisted);
+    mar_stat_field(refs);
+    mar_stat_field(strrefs);
+    mar_stat_field(protos);
+    mar_stat_field(reallocs);
+    mar_stat_field(depth);
+#undef mar_stat_field
+    lua_pushnumber(L, (lua_Number)mar_stats.persist_time / CLOCKS_PER_SEC);
+    lua_setfield(L, -2, "persist_time");
+    lua_newtable(L);
+    for (i = 0; i <= LUA_TTHREAD; i++) {
+        if (mar_stats.bytes[i] == 0) continue;
+        mar_pushint(L, mar_stats.bytes[i]);
+        lua_setfield(L, -2, lua_typename(L, i));
+    }
+    lua_setfield(L, -2, "bytes");
+    if (lua_toboolean(L, 1)) memset(&mar_stats, 0, sizeof(mar_stats));
+    return 1;
+}
+#endif
+
+/* Forgets what the last value of a batch wrote, so that the next one
+ * doesn't refer back into it: objects and interned strings, anchored
+ * callbacks and function prototypes. The constants are entered once as a
+ * constants object, so they aren't in the seen set or table. */
+static void mar_encode_reset(lua_State *L, mar_Ctx *ctx, size_t base)
+{
+    seen_clear(L, ctx->objs);
+    lua_pushnil(L);
+    while (lua_next(L, SEEN_IDX) != 0) {
+        lua_pop(L, 1);
+        if (lua_type(L, -1) != LUA_TLIGHTUSERDATA) {
+            lua_pushvalue(L, -1);
+            lua_pushnil(L);
+            lua_rawset(L, SEEN_IDX);
+        }
+    }
+    mar_push_protos(L);
+    mar_clear_table(L, lua_gettop(L));
+    lua_pop(L, 1);
+    ctx->idx = base;
+    ctx->nprotos = 0;
+    ctx->nshapes = 0;
+}
+
+/* A batch is a header with MAR_FMANY set, the number of values and the
+ * values one after another. They share the constants and the encoder's
+ * buffers, and with MAR_FSHARE the seen set too. */
+static int mar_encode_many(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Encoder *enc;
+    size_t i, n, base;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    mar_check_options(L, 3, "encode_many", &ctx);
+    ctx.flags = (ctx.flags | MAR_FMANY) & ~MAR_FINDEX;
+    if (lua_istable(L, 3)) {
+        lua_getfield(L, 3, "shared");
+        if (lua_toboolean(L, -1)) ctx.flags |= MAR_FSHARE;
+        lua_pop(L, 1);
+    }
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.index = NULL;
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "encode_many");
+    if (lua_istable(L, 2) && !(ctx.flags & MAR_FSHARE)) {
+        lua_pushcfunction(L, mar_constants);
+        lua_pushvalue(L, 2);
+        lua_call(L, 1, 1);
+        lua_replace(L, 2);
+    }
+
+    lua_newtable(L);
+    ctx.arena = mar_push_arena(L);
+    enc = mar_push_encoder(L, &ctx); /* list, k, seen, arena, enc */
+    ctx.scratch = &enc->code;
+    ctx.objs = &enc->objs;
+    base = ctx.idx = mar_encode_seen(L, &ctx);
+
+    n = lua_objlen(L, 1);
+    mar_encode_head(L, &enc->buf, &ctx);
+    mar_write_size(L, &ctx, &enc->buf, n);
+    for (i = 1; i <= n; i++) {
+        if (i > 1 && !(ctx.flags & MAR_FSHARE)) mar_encode_reset(L, &ctx, base);
+        lua_rawgeti(L, 1, (int)i);
+        mar_encode_value(L, &enc->buf, -1, &ctx);
+        lua_pop(L, 1);
+    }
+
+    if (ctx.flags & MAR_FLZ) {
+        lz_buffer(L, &enc->buf, &enc->code, ctx.threads);
+        lua_pushlstring(L, enc->code.data, enc->code.head);
+    }
+    else {
+        lua_pushlstring(L, enc->buf.data, enc->buf.head);
+    }
+    arena_release(L, ctx.arena);
+    return 1;
+}
+
+static int mar_decode_many(lua_State *L)
+{
+    mar_Decoder d;
+    size_t l, i, n = 1, idx;
+    const char *s = luaL_checklstring(L, 1, &l);
+
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "decode_many");
+    lua_newtable(L);
+    idx = mar_decode_seen(L);
+    lua_pushnil(L);
+    lua_pushnil(L); /* s, k, seen, T, K */
+    if (l >= MAR_HEAD_SIZE && mar_is_lz(s)) {
+        s = mar_inflate(L, s, l, &l);
+    }
+
+    dec_init(&d, idx);
+    d.data = s;
+    d.len = l;
+    d.many = 1;
+    if (!dec_magic(L, &d)) luaL_error(L, l == 0 ? "bad header" : "bad code");
+    if ((d.ctx.flags & MAR_FMANY) && !dec_size(L, &d, &n)) luaL_error(L, "bad code");
+    if (n > dec_avail(&d)) luaL_error(L, "bad code");
+
+    lua_createtable(L, (int)n, 0);
+    for (i = 1; i <= n; i++) {
+        d.done = 0;
+        if (!(d.ctx.flags & MAR_FSHARE)) {
+            d.ctx.idx = idx;
+            d.ctx.nprotos = 0;
+            d.ctx.nshapes = 0;
+        }
+        if (!dec_run(L, &d)) luaL_error(L, "bad code");
+        lua_rawgeti(L, SEEN_IDX, 0);
+        lua_rawseti(L, -2, (int)i);
+    }
+    if (!(d.ctx.flags & MAR_FINDEX) && d.pos != d.len) luaL_error(L, "bad code");
+    return 1;
+}
+
+static const luaL_reg encoder_R[] =
+{
+    {"encode",      mar_encoder_encode},
+    {NULL,	    NULL}
+};
+
+static const luaL_reg decoder_R[] =
+{
+    {"feed",        mar_decoder_feed},
+    {"result",      mar_decoder_result},
+    {NULL,	    NULL}
+};
+
+/* A delta is a header with MAR_FDIFF set and a tree of edits, each one a
+ * table { del, sub } at [2] and [3]: a list of keys to clear and, by key,
+ * the edits of the tables that are kept. Patching edits those tables in
+ * place, so whatever refers to them in the target still does afterwards.
+ * A root that can't be edited is replaced by the value boxed at [4]. The
+ * tree is built and applied with a queue, not by recursion.
+ *
+ * The values to assign are encoded apart, as a second delta in the root's
+ * [7]: by edit number (an edit's [5]), the keys to assign with their new
+ * values. Kept tables they refer to, at any depth, are written as refs to
+ * extra constants after the caller's, two (the new and the old table) for
+ * each edit number in the root's [6]. Patching finds those edits' targets
+ * first and decodes the values with the targets in their place, so a table
+ * that gains a reference or moves is still the same table. */
+
+/* true if the table at idx can be edited in place: keys that compare the
+ * same in another state and no __persist hook */
+static int mar_diffable(lua_State *L, int idx)
+{
+    if (luaL_getmetafield(L, idx, "__persist")) {
+        lua_pop(L, 1);
+        return 0;
+    }
+    lua_pushnil(L);
+    while (lua_next(L, idx) != 0) {
+        int t = lua_type(L, -2);
+        lua_pop(L, 1);
+        if (t != LUA_TSTRING && t != LUA_TNUMBER && t != LUA_TBOOLEAN) {
+            lua_pop(L, 1);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* true if the values at a and b are written the same way */
+static int mar_same(lua_State *L, int a, int b)
+{
+    if (!lua_rawequal(L, a, b)) return 0;
+#if LUA_VERSION_NUM >= 503
+    if (lua_type(L, a) == LUA_TNUMBER) return lua_isinteger(L, a) == lua_isinteger(L, b);
+#endif
+    return 1;
+}
+
+/* pushes field i of the edit at idx, making it first if need be */
+static void mar_edit_field(lua_State *L, int idx, int i)
+{
+    lua_rawgeti(L, idx, i);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, idx, i);
+    }
+}
+
+#define MAR_DIFF_MAP  5  /* new table -> the old table it is diffed with */
+#define MAR_DIFF_RMAP 6  /* and back */
+#define MAR_DIFF_Q    7  /* old, new, edit, parent edit, key for each pair */
+#define MAR_DIFF_ROOT 8
+#define MAR_DIFF_IDS  9  /* old and new table -> number of their pair */
+#define MAR_DIFF_REFS 10 /* pairs the assigned values refer to */
+
+/* queues the tables at o and n, which are at the key at -1 of the parent
+ * edit at e (or none), as a pair to diff */
+static void mar_diff_queue(lua_State *L, int o, int n, int e, size_t *len)
+{
+    int top = lua_gettop(L);
+    lua_pushvalue(L, n);
+    lua_pushvalue(L, o);
+    lua_rawset(L, MAR_DIFF_MAP);
+    lua_pushvalue(L, o);
+    lua_pushvalue(L, n);
+    lua_rawset(L, MAR_DIFF_RMAP);
+    lua_pushvalue(L, o);
+    lua_pushnumber(L, (lua_Number)(*len / 5 + 1));
+    lua_rawset(L, MAR_DIFF_IDS);
+    lua_pushvalue(L, n);
+    lua_pushnumber(L, (lua_Number)(*len / 5 + 1));
+    lua_rawset(L, MAR_DIFF_IDS);
+
+    lua_pushvalue(L, o);
+    lua_rawseti(L, MAR_DIFF_Q, (int)++*len);
+    lua_pushvalue(L, n);
+    lua_rawseti(L, MAR_DIFF_Q, (int)++*len);
+    if (e) {
+        lua_newtable(L);
+        mar_edit_field(L, e, 3);
+        lua_pushvalue(L, top);
+        lua_pushvalue(L, -3);
+        lua_rawset(L, -3);
+        lua_pop(L, 1);
+    }
+    else {
+        lua_pushvalue(L, MAR_DIFF_ROOT);
+    }
+    lua_rawseti(L, MAR_DIFF_Q, (int)++*len);
+    if (e) lua_pushvalue(L, e); else lua_pushnil(L);
+    lua_rawseti(L, MAR_DIFF_Q, (int)++*len);
+    if (e) lua_pushvalue(L, top); else lua_pushnil(L);
+    lua_rawseti(L, MAR_DIFF_Q, (int)++*len);
+    lua_settop(L, top);
+}
+
+/* diffs the pair of tables at o and n into the edit at e */
+static void mar_diff_pair(lua_State *L, int o, int n, int e, size_t *len)
+{
+    lua_pushnil(L);
+    while (lua_next(L, n) != 0) {       /* k, v */
+        lua_pushvalue(L, -2);
+        lua_rawget(L, o);               /* k, v, ov */
+        if (lua_isnil(L, -1) || !mar_same(L, -2, -1)) {
+            int keep = 0;
+            if (lua_istable(L, -1) && lua_istable(L, -2)) {
+                int v = lua_gettop(L) - 1;
+                lua_pushvalue(L, v);
+                lua_rawget(L, MAR_DIFF_MAP);
+                lua_pushvalue(L, v + 1);
+                lua_rawget(L, MAR_DIFF_RMAP); /* k, v, ov, map[v], rmap[ov] */
+                if (lua_rawequal(L, -2, v + 1)) {
+                    keep = 1;
+                }
+                else if (lua_isnil(L, -2) && lua_isnil(L, -1)
+                         && mar_diffable(L, v) && mar_diffable(L, v + 1)) {
+                    lua_pushvalue(L, v - 1);
+                    mar_diff_queue(L, v + 1, v, e, len);
+                    lua_pop(L, 1);
+                    keep = 1;
+                }
+                lua_pop(L, 2);
+            }
+            if (!keep) {
+                mar_edit_field(L, e, 1);
+                lua_pushvalue(L, -4);
+                lua_pushvalue(L, -4);
+                lua_rawset(L, -3);
+                lua_pop(L, 1);
+            }
         }
-        break;
+        lua_pop(L, 2);
     }
-    case LUA_TFUNCTION: {
-        size_t nups;
-        int i;
-        mar_Buffer dec_buf;
-        char tag = *(char*)*p;
-        mar_incr_ptr(1);
-        if (tag == MAR_TREF) {
-            int ref;
-            mar_next_len(ref, int);
-            lua_rawgeti(L, SEEN_IDX, ref);
+
+    lua_pushnil(L);
+    while (lua_next(L, o) != 0) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_rawget(L, n);
+        if (lua_isnil(L, -1)) {
+            mar_edit_field(L, e, 2);
+            lua_pushvalue(L, -3);
+            lua_rawseti(L, -2, (int)lua_objlen(L, -2) + 1);
+            lua_pop(L, 1);
         }
-        else {
-            mar_next_len(l, uint32_t);
-            dec_buf.data = (char*)*p;
-            dec_buf.size = l;
-            dec_buf.head = l;
-            dec_buf.seek = 0;
-            lua_load(L, (lua_Reader)buf_read, &dec_buf, "=marshal");
-            mar_incr_ptr(l);
+        lua_pop(L, 1);
+    }
+}
 
-            lua_pushvalue(L, -1);
-            lua_rawseti(L, SEEN_IDX, (*idx)++);
+/* pushes field i of the pair numbered id in the diff queue */
+static void mar_diff_field(lua_State *L, size_t id, int i)
+{
+    lua_rawgeti(L, MAR_DIFF_Q, (int)(5 * (id - 1)) + i);
+}
 
-            mar_next_len(l, uint32_t);
-            lua_newtable(L);
-            mar_decode_table(L, *p, l, idx);
-            nups = lua_objlen(L, -1);
-            for (i=1; i <= nups; i++) {
-                lua_rawgeti(L, -1, i);
-                lua_setupvalue(L, -3, i);
-            }
-            lua_pop(L, 1);
-            mar_incr_ptr(l);
+/* pushes a table if the value on top is one or a function, to be walked */
+static void mar_diff_push(lua_State *L, int work, size_t *nwork)
+{
+    if (lua_istable(L, -1) || lua_isfunction(L, -1)) {
+        lua_rawseti(L, work, (int)++*nwork);
+    }
+    else {
+        lua_pop(L, 1);
+    }
+}
+
+/* Walks the values assigned by the len / 5 edits in the queue, and marks
+ * the kept tables they reach, listing their pairs in MAR_DIFF_REFS. What's
+ * inside a kept table isn't walked: it is patched in place. */
+static void mar_diff_refs(lua_State *L, size_t len)
+{
+    size_t i, nwork = 0, nrefs = 0;
+    int top = lua_gettop(L), seen = top + 1, work = top + 2;
+    lua_newtable(L);
+    lua_newtable(L);
+    for (i = 0; i < len; i += 5) {
+        lua_rawgeti(L, MAR_DIFF_Q, (int)i + 3);
+        lua_rawgeti(L, -1, 1);
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0) mar_diff_push(L, work, &nwork);
         }
-        break;
+        lua_pop(L, 2);
     }
-    case LUA_TUSERDATA: {
-        char tag = *(char*)*p;
-        mar_incr_ptr(MAR_CHR);
-        if (tag == MAR_TREF) {
-            int ref;
-            mar_next_len(ref, int);
-            lua_rawgeti(L, SEEN_IDX, ref);
+    while (nwork > 0) {
+        int v = lua_gettop(L) + 1;
+        lua_rawgeti(L, work, (int)nwork--);
+        lua_pushvalue(L, v);
+        lua_rawget(L, MAR_DIFF_IDS);
+        if (lua_isnumber(L, -1)) {
+            size_t id = (size_t)lua_tonumber(L, -1);
+            mar_diff_field(L, id, 3);
+            lua_rawgeti(L, -1, 5);
+            if (lua_isnil(L, -1)) {
+                lua_pushboolean(L, 1);
+                lua_rawseti(L, -3, 5);
+                lua_pushnumber(L, (lua_Number)id);
+                lua_rawseti(L, MAR_DIFF_REFS, (int)++nrefs);
+            }
+            lua_settop(L, v - 1);
+            continue;
         }
-        else if (tag == MAR_TUSR) {
-            mar_next_len(l, uint32_t);
-            lua_newtable(L);
-            mar_decode_table(L, *p, l, idx);
-            lua_rawgeti(L, -1, 1);
-            lua_call(L, 0, 1);
-            lua_remove(L, -2);
-            lua_pushvalue(L, -1);
-            lua_rawseti(L, SEEN_IDX, (*idx)++);
-            mar_incr_ptr(l);
+        lua_pop(L, 1);
+        lua_pushvalue(L, v);
+        lua_rawget(L, seen);
+        if (!lua_isnil(L, -1)) {
+            lua_settop(L, v - 1);
+            continue;
         }
-        else { /* tag == MAR_TVAL */
+        lua_pop(L, 1);
+        lua_pushvalue(L, v);
+        lua_pushboolean(L, 1);
+        lua_rawset(L, seen);
+        if (lua_istable(L, v)) {
             lua_pushnil(L);
+            while (lua_next(L, v) != 0) {
+                lua_pushvalue(L, -2);
+                mar_diff_push(L, work, &nwork);
+                mar_diff_push(L, work, &nwork);
+            }
         }
-        break;
+        else {
+            int n;
+            for (n = 1; lua_getupvalue(L, v, n) != NULL; n++) {
+                mar_diff_push(L, work, &nwork);
+            }
+        }
+        lua_settop(L, v - 1);
     }
-    case LUA_TNIL:
-    case LUA_TTHREAD:
-        lua_pushnil(L);
-        break;
-    default:
-        luaL_error(L, "bad code");
+    lua_settop(L, top);
+}
+
+/* pushes a copy of the list of the constants at idx, returning its length */
+static size_t mar_diff_consts(lua_State *L, int idx)
+{
+    mar_Constants *k = mar_toconstants(L, idx);
+    size_t i, n = 0;
+    lua_newtable(L);
+    if (k) {
+        n = k->n;
+        lua_getfenv(L, idx);
+    }
+    else if (lua_istable(L, idx)) {
+        n = lua_objlen(L, idx);
+        lua_pushvalue(L, idx);
+    }
+    else {
+        return 0;
     }
+    for (i = 1; i <= n; i++) {
+        lua_rawgeti(L, -1, (int)i);
+        lua_rawseti(L, -3, (int)i);
+    }
+    lua_pop(L, 1);
+    return n;
 }
 
-static int mar_decode_table(lua_State *L, const char* buf, size_t len, size_t *idx)
+/* Numbers the edits that assign values or are referred to, and moves what
+ * they assign into the second delta. */
+static void mar_diff_sets(lua_State *L, size_t len)
 {
-    const char* p;
-    p = buf;
-    while (p - buf < len) {
-        mar_decode_value(L, buf, len, &p, idx);
-        mar_decode_value(L, buf, len, &p, idx);
-        lua_settable(L, -3);
+    size_t i, n = 0, j, nrefs = lua_objlen(L, MAR_DIFF_REFS), nk;
+    int top = lua_gettop(L), sets = top + 1;
+    lua_newtable(L);
+    for (i = 0; i < len; i += 5) {
+        lua_rawgeti(L, MAR_DIFF_Q, (int)i + 3);
+        lua_rawgeti(L, -1, 1);
+        lua_rawgeti(L, -2, 5);
+        if (!lua_isnil(L, -1) || !lua_isnil(L, -2)) {
+            lua_pushnumber(L, (lua_Number)++n);
+            lua_rawseti(L, -4, 5);
+            lua_pushvalue(L, -2);
+            lua_rawseti(L, sets, (int)n);
+            lua_pushnil(L);
+            lua_rawseti(L, -4, 1);
+        }
+        lua_settop(L, sets);
     }
-    return 1;
+
+    nk = mar_diff_consts(L, 3); /* sets, constants */
+    for (j = 1; j <= nrefs; j++) {
+        size_t id;
+        lua_rawgeti(L, MAR_DIFF_REFS, (int)j);
+        id = (size_t)lua_tonumber(L, -1);
+        lua_pop(L, 1);
+        mar_diff_field(L, id, 2);
+        lua_rawseti(L, -2, (int)(nk + 2 * j - 1));
+        mar_diff_field(L, id, 1);
+        lua_rawseti(L, -2, (int)(nk + 2 * j));
+        mar_diff_field(L, id, 3);
+        lua_rawgeti(L, -1, 5);
+        lua_rawseti(L, MAR_DIFF_REFS, (int)j);
+        lua_pop(L, 1);
+    }
+    if (nrefs) {
+        lua_pushvalue(L, MAR_DIFF_REFS);
+        lua_rawseti(L, MAR_DIFF_ROOT, 6);
+    }
+    if (n) {
+        lua_pushcfunction(L, mar_encode_delta);
+        lua_pushvalue(L, sets);
+        lua_pushvalue(L, sets + 1);
+        lua_pushvalue(L, 4);
+        lua_call(L, 3, 1);
+        lua_rawseti(L, MAR_DIFF_ROOT, 7);
+    }
+    lua_settop(L, top);
 }
 
-static int mar_encode(lua_State* L)
+/* diff(old, new[, constants[, options]]): old is an encoded snapshot or
+ * a decoded one */
+static int mar_diff(lua_State *L)
 {
-    const unsigned char m = MAR_MAGIC;
-    size_t idx, len;
-    mar_Buffer buf;
+    size_t i, len = 0, npairs;
 
-    if (lua_isnone(L, 1)) {
-        lua_pushnil(L);
+    lua_settop(L, 4);
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        lua_pushcfunction(L, mar_decode);
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 3);
+        lua_call(L, 2, 1);
+        lua_replace(L, 1);
     }
-    if (lua_isnoneornil(L, 2)) {
-        lua_newtable(L);
+    for (i = MAR_DIFF_MAP; i <= MAR_DIFF_REFS; i++) lua_newtable(L);
+
+    if (mar_same(L, 1, 2)) {
+        /* nothing changed */
+    }
+    else if (lua_istable(L, 1) && lua_istable(L, 2)
+             && mar_diffable(L, 1) && mar_diffable(L, 2)) {
+        mar_diff_queue(L, 1, 2, 0, &len);
+    }
+    else {
+        lua_createtable(L, 1, 0);
+        lua_pushvalue(L, 2);
+        lua_rawseti(L, -2, 1);
+        lua_rawseti(L, MAR_DIFF_ROOT, 4);
     }
-    else if (!lua_istable(L, 2)) {
-        luaL_error(L, "bad argument #2 to encode (expected table)");
+
+    luaL_checkstack(L, 16, "diff");
+    for (i = 0; i < len; i += 5) {
+        int base = lua_gettop(L) + 1;
+        lua_rawgeti(L, MAR_DIFF_Q, (int)i + 1);
+        lua_rawgeti(L, MAR_DIFF_Q, (int)i + 2);
+        lua_rawgeti(L, MAR_DIFF_Q, (int)i + 3);
+        mar_diff_pair(L, base, base + 1, base + 2, &len);
+        lua_settop(L, base - 1);
+    }
+    mar_diff_refs(L, len);
+    npairs = len;
+
+    /* drop the edits that came to nothing, children before parents */
+    while (len > 0) {
+        len -= 5;
+        lua_rawgeti(L, MAR_DIFF_Q, (int)len + 3);
+        lua_pushnil(L);
+        if (len > 0 && lua_next(L, -2) == 0) {
+            lua_rawgeti(L, MAR_DIFF_Q, (int)len + 4);
+            lua_rawgeti(L, -1, 3);
+            lua_rawgeti(L, MAR_DIFF_Q, (int)len + 5);
+            lua_pushnil(L);
+            lua_rawset(L, -3);
+            lua_pushnil(L);
+            if (lua_next(L, -2) == 0) {
+                lua_pushnil(L);
+                lua_rawseti(L, -3, 3);
+            }
+            else {
+                lua_pop(L, 2);
+            }
+        }
+        lua_settop(L, MAR_DIFF_REFS);
     }
+    mar_diff_sets(L, npairs);
+
+    lua_pushcfunction(L, mar_encode_delta);
+    lua_pushvalue(L, MAR_DIFF_ROOT);
+    lua_pushvalue(L, 3);
+    lua_pushvalue(L, 4);
+    lua_call(L, 3, 1);
+    return 1;
+}
+
+static int mar_decode_delta(lua_State *L)
+{
+    size_t l;
+    const char *s = luaL_checklstring(L, 1, &l);
+
     lua_settop(L, 2);
+    mar_check_constants(L, 2, "patch");
+    mar_decode_mem(L, s, l, 1);
+    return 1;
+}
 
-    len = lua_objlen(L, 2);
-    lua_newtable(L);
-    for (idx = 1; idx <= len; idx++) {
-        lua_rawgeti(L, 2, idx);
-        if (lua_isnil(L, -1)) {
-            lua_pop(L, 1);
-            continue;
+/* patch(target, delta[, constants]): applies a delta to the snapshot it
+ * was made against, returning it, or the new root if that was replaced */
+static int mar_patch_delta(lua_State *L)
+{
+    size_t head = 0, tail = 0, nk, j, nrefs;
+
+    lua_settop(L, 3);
+    luaL_checkstring(L, 2);
+    lua_pushcfunction(L, mar_decode_delta);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_call(L, 2, 1);                  /* t, delta, k, edit */
+    if (!lua_istable(L, 4)) luaL_error(L, "bad code");
+    lua_rawgeti(L, 4, 4);
+    if (lua_istable(L, -1)) {
+        lua_rawgeti(L, -1, 1);
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    lua_newtable(L);                    /* 5: target, edit for each pair */
+    lua_newtable(L);                    /* 6: target of each numbered edit */
+    lua_pushvalue(L, 1);
+    lua_rawseti(L, 5, (int)++tail);
+    lua_pushvalue(L, 4);
+    lua_rawseti(L, 5, (int)++tail);
+
+    /* the keys cleared and the targets found before anything is assigned,
+     * which they can't depend on */
+    while (head < tail) {
+        lua_rawgeti(L, 5, (int)++head); /* 7: t */
+        lua_rawgeti(L, 5, (int)++head); /* 8: e */
+        if (!lua_istable(L, 7) || !lua_istable(L, 8)) {
+            luaL_error(L, "delta doesn't match the target");
         }
-        lua_pushinteger(L, idx);
-        lua_rawset(L, SEEN_IDX);
+        lua_rawgeti(L, 8, 5);
+        if (lua_isnumber(L, -1)) {
+            lua_pushvalue(L, 7);
+            lua_rawseti(L, 6, (int)lua_tointeger(L, -2));
+        }
+        lua_pop(L, 1);
+        lua_rawgeti(L, 8, 2);
+        if (lua_istable(L, -1)) {
+            size_t i, n = lua_objlen(L, -1);
+            for (i = 1; i <= n; i++) {
+                lua_rawgeti(L, -1, (int)i);
+                lua_pushnil(L);
+                lua_rawset(L, 7);
+            }
+        }
+        lua_pop(L, 1);
+        lua_rawgeti(L, 8, 3);
+        if (lua_istable(L, -1)) {
+            lua_pushnil(L);
+            while (lua_next(L, -2) != 0) {
+                lua_pushvalue(L, -2);
+                lua_rawget(L, 7);
+                lua_rawseti(L, 5, (int)++tail);
+                lua_rawseti(L, 5, (int)++tail);
+            }
+        }
+        lua_settop(L, 6);
+    }
+
+    lua_rawgeti(L, 4, 7);               /* 7: values to assign */
+    if (lua_isnil(L, 7)) {
+        lua_pushvalue(L, 1);
+        return 1;
+    }
+    lua_pushcfunction(L, mar_decode_delta);
+    lua_insert(L, 7);
+    nk = mar_diff_consts(L, 3);         /* decode, values, constants */
+    lua_rawgeti(L, 4, 6);
+    nrefs = lua_istable(L, -1) ? lua_objlen(L, -1) : 0;
+    for (j = 1; j <= nrefs; j++) {
+        lua_rawgeti(L, -1, (int)j);
+        lua_rawget(L, 6);
+        if (!lua_istable(L, -1)) luaL_error(L, "delta doesn't match the target");
+        lua_pushvalue(L, -1);
+        lua_rawseti(L, -4, (int)(nk + 2 * j - 1));
+        lua_rawseti(L, -3, (int)(nk + 2 * j));
+    }
+    lua_pop(L, 1);
+    lua_call(L, 2, 1);                  /* 7: by edit number, keys and values */
+    if (!lua_istable(L, 7)) luaL_error(L, "bad code");
+
+    lua_pushnil(L);
+    while (lua_next(L, 7) != 0) {
+        lua_pushvalue(L, -2);
+        lua_rawget(L, 6);
+        if (!lua_istable(L, -1) || !lua_istable(L, -2)) {
+            luaL_error(L, "delta doesn't match the target");
+        }
+        lua_pushnil(L);
+        while (lua_next(L, -3) != 0) {
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, -4);
+        }
+        lua_pop(L, 2);
     }
+
     lua_pushvalue(L, 1);
+    return 1;
+}
 
-    buf_init(L, &buf);
-    buf_write(L, (void*)&m, 1, &buf);
+/* C interface, see lmarshal.h. The work is done by C functions called
+ * through lua_pcall, which gives them a stack of their own and catches
+ * errors for the callers. */
 
-    mar_encode_value(L, &buf, -1, &idx);
+/* (v, constants, bytes): encodes v into malloc'd memory */
+static int mar_encode_bytes(lua_State *L)
+{
+    mar_Ctx ctx;
+    mar_Encoder *enc;
+    mar_Bytes *out = (mar_Bytes*)lua_touserdata(L, 3);
 
-    lua_pop(L, 1);
+    mar_check_options(L, 4, "encode", &ctx);
+    ctx.nprotos = 0;
+    ctx.nshapes = 0;
+    ctx.scratch = NULL;
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "encode");
 
-    lua_pushlstring(L, buf.data, buf.head);
+    lua_newtable(L);
+    ctx.arena = mar_push_arena(L);
+    enc = mar_own(L, &ctx);
+    /* the output outlives the call, the encoder's __gc frees it on errors */
+    buf_done(L, &enc->buf);
+    enc->buf.data = NULL;
+    buf_init(L, &enc->buf, MAR_HEAP);
+    ctx.idx = mar_encode_seen(L, &ctx);
 
-    buf_done(L, &buf);
+    mar_encode_buf(L, &enc->buf, &ctx);
+    out->data = enc->buf.data;
+    out->len = enc->buf.head;
+    enc->buf.data = NULL;
 
-    lua_remove(L, SEEN_IDX);
+    arena_release(L, ctx.arena);
+    return 0;
+}
 
+/* (bytes, constants): decodes what bytes points to */
+static int mar_decode_bytes(lua_State *L)
+{
+    mar_Bytes *in = (mar_Bytes*)lua_touserdata(L, 1);
+    lua_settop(L, 2);
+    mar_check_constants(L, 2, "decode");
+    mar_decode_mem(L, in->data, in->len, 0);
     return 1;
 }
 
-static int mar_decode(lua_State* L)
+LUALIB_API int mar_encode_to_buffer(lua_State *L, int idx, mar_Bytes *buf)
 {
-    size_t l, idx, len;
-    const char *p;
-    const char *s = luaL_checklstring(L, 1, &l);
+    if (idx < 0 && idx > LUA_REGISTRYINDEX) idx = lua_gettop(L) + idx + 1;
+    lua_pushcfunction(L, mar_encode_bytes);
+    lua_pushvalue(L, idx);
+    lua_pushnil(L);
+    lua_pushlightuserdata(L, buf);
+    return lua_pcall(L, 3, 0, 0);
+}
 
-    if (l < 1) luaL_error(L, "bad header");
-    if (*(unsigned char *)s++ != MAR_MAGIC) luaL_error(L, "bad magic");
-    l -= 1;
+LUALIB_API int mar_decode_from_buffer(lua_State *L, const char *data, size_t len)
+{
+    mar_Bytes in;
+    in.data = (char*)data;
+    in.len = len;
+    lua_pushcfunction(L, mar_decode_bytes);
+    lua_pushlightuserdata(L, &in);
+    lua_pushnil(L);
+    return lua_pcall(L, 2, 1, 0);
+}
 
-    if (lua_isnoneornil(L, 2)) {
-        lua_newtable(L);
-    }
-    else if (!lua_istable(L, 2)) {
-        luaL_error(L, "bad argument #2 to decode (expected table)");
+LUALIB_API void mar_free_buffer(mar_Bytes *buf)
+{
+    free(buf->data);
+    buf->data = NULL;
+    buf->len = 0;
+}
+
+#ifdef MAR_THREADS
+/* A ring of cap messages, a power of two. head is only written by the
+ * consumer and tail by the producer; each publishes its index with a
+ * release store after touching the ring, and reads the other's with an
+ * acquire load.
+ *
+ * Live channels are also kept in a list under mar_channels_lock, which
+ * guards refs and the list. A handle is a channel's id rather than its
+ * address, so opening one looks it up there and can't reach a channel
+ * that is gone. */
+struct mar_Channel {
+    size_t refs;
+    size_t id;
+    mar_Channel *next;
+    mar_Channel *prev;
+    size_t cap;
+    size_t head;
+    size_t tail;
+    mar_Bytes ring[1];
+};
+
+static pthread_mutex_t mar_channels_lock = PTHREAD_MUTEX_INITIALIZER;
+static mar_Channel *mar_channels;
+static size_t mar_channel_ids;
+
+#define ch_load(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ch_store(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+LUALIB_API mar_Channel *mar_channel_new(size_t capacity)
+{
+    mar_Channel *ch;
+    size_t cap = 1;
+    while (cap < capacity && cap <= ((size_t)-1 >> 2) / sizeof(mar_Bytes)) cap <<= 1;
+    ch = (mar_Channel*)malloc(sizeof(mar_Channel) + (cap - 1) * sizeof(mar_Bytes));
+    if (!ch) return NULL;
+    ch->refs = 1;
+    ch->cap = cap;
+    ch->head = 0;
+    ch->tail = 0;
+    ch->prev = NULL;
+    pthread_mutex_lock(&mar_channels_lock);
+    ch->id = ++mar_channel_ids;
+    ch->next = mar_channels;
+    if (mar_channels) mar_channels->prev = ch;
+    mar_channels = ch;
+    pthread_mutex_unlock(&mar_channels_lock);
+    return ch;
+}
+
+LUALIB_API void mar_channel_release(mar_Channel *ch)
+{
+    mar_Bytes msg;
+    pthread_mutex_lock(&mar_channels_lock);
+    if (--ch->refs != 0) {
+        pthread_mutex_unlock(&mar_channels_lock);
+        return;
     }
-    lua_settop(L, 2);
+    if (ch->prev) ch->prev->next = ch->next;
+    else mar_channels = ch->next;
+    if (ch->next) ch->next->prev = ch->prev;
+    pthread_mutex_unlock(&mar_channels_lock);
+    while (mar_channel_receive(ch, &msg)) mar_free_buffer(&msg);
+    free(ch);
+}
 
-    len = lua_objlen(L, 2);
-    lua_newtable(L);
-    for (idx = 1; idx <= len; idx++) {
-        lua_rawgeti(L, 2, idx);
-        lua_rawseti(L, SEEN_IDX, idx);
+LUALIB_API int mar_channel_send(mar_Channel *ch, mar_Bytes *msg)
+{
+    size_t tail = ch->tail;
+    if (tail - ch_load(&ch->head) == ch->cap) return 0;
+    ch->ring[tail & (ch->cap - 1)] = *msg;
+    ch_store(&ch->tail, tail + 1);
+    return 1;
+}
+
+LUALIB_API int mar_channel_receive(mar_Channel *ch, mar_Bytes *msg)
+{
+    size_t head = ch->head;
+    if (head == ch_load(&ch->tail)) return 0;
+    *msg = ch->ring[head & (ch->cap - 1)];
+    ch_store(&ch->head, head + 1);
+    return 1;
+}
+
+/* pushes an empty channel object, for a reference to be put in */
+static mar_Channel **mar_new_channel_ud(lua_State *L)
+{
+    mar_Channel **p = (mar_Channel**)lua_newuserdata(L, sizeof(mar_Channel*));
+    *p = NULL;
+    luaL_getmetatable(L, MAR_CHANNEL);
+    lua_setmetatable(L, -2);
+    return p;
+}
+
+LUALIB_API void mar_channel_push(lua_State *L, mar_Channel *ch)
+{
+    mar_Channel **p = mar_new_channel_ud(L);
+    pthread_mutex_lock(&mar_channels_lock);
+    ch->refs++;
+    pthread_mutex_unlock(&mar_channels_lock);
+    *p = ch;
+}
+
+/* a new reference to the live channel with this id, or NULL */
+static mar_Channel *mar_channel_open(size_t id)
+{
+    mar_Channel *ch;
+    pthread_mutex_lock(&mar_channels_lock);
+    for (ch = mar_channels; ch && ch->id != id; ch = ch->next);
+    if (ch) ch->refs++;
+    pthread_mutex_unlock(&mar_channels_lock);
+    return ch;
+}
+
+static mar_Channel *mar_check_channel(lua_State *L)
+{
+    mar_Channel **p = (mar_Channel**)luaL_checkudata(L, 1, MAR_CHANNEL);
+    if (!*p) luaL_error(L, "channel is closed");
+    return *p;
+}
+
+/* channel([capacity]) makes a channel, channel(handle) opens the one whose
+ * handle() that is, while it is still held somewhere */
+static int mar_channel(lua_State *L)
+{
+    mar_Channel *ch;
+    if (lua_islightuserdata(L, 1)) {
+        mar_Channel **p = mar_new_channel_ud(L);
+        *p = mar_channel_open((size_t)(uintptr_t)lua_touserdata(L, 1));
+        if (!*p) luaL_error(L, "bad channel handle (unknown or closed)");
+        return 1;
     }
+    ch = mar_channel_new((size_t)luaL_optnumber(L, 1, 64));
+    if (!ch) luaL_error(L, "Out of memory!");
+    mar_channel_push(L, ch);
+    mar_channel_release(ch);
+    return 1;
+}
 
-    p = s;
-    mar_decode_value(L, s, l, &p, &idx);
+/* send(v[, constants]): true, or false if the channel is full */
+static int mar_channel_send_l(lua_State *L)
+{
+    mar_Channel *ch = mar_check_channel(L);
+    mar_Bytes msg;
+    if (ch->tail - ch_load(&ch->head) == ch->cap) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_settop(L, 3);
+    lua_pushcfunction(L, mar_encode_bytes);
+    lua_pushvalue(L, 2);
+    lua_pushvalue(L, 3);
+    lua_pushlightuserdata(L, &msg);
+    lua_call(L, 3, 0);
+    mar_channel_send(ch, &msg); /* only this side fills it */
+    lua_pushboolean(L, 1);
+    return 1;
+}
 
-    lua_remove(L, SEEN_IDX);
-    lua_remove(L, 2);
+/* receive([constants]): true and the oldest message, or false if there is
+ * none */
+static int mar_channel_receive_l(lua_State *L)
+{
+    mar_Channel *ch = mar_check_channel(L);
+    mar_Bytes msg;
+    int r;
+    lua_settop(L, 2);
+    if (!mar_channel_receive(ch, &msg)) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    lua_pushboolean(L, 1);
+    lua_pushcfunction(L, mar_decode_bytes);
+    lua_pushlightuserdata(L, &msg);
+    lua_pushvalue(L, 2);
+    r = lua_pcall(L, 2, 1, 0);
+    mar_free_buffer(&msg);
+    if (r != 0) lua_error(L);
+    return 2;
+}
 
+static int mar_channel_handle(lua_State *L)
+{
+    lua_pushlightuserdata(L, (void*)(uintptr_t)mar_check_channel(L)->id);
     return 1;
 }
 
-static int mar_clone(lua_State* L)
+static int mar_channel_len(lua_State *L)
 {
-    mar_encode(L);
-    lua_replace(L, 1);
-    mar_decode(L);
+    mar_Channel *ch = mar_check_channel(L);
+    lua_pushnumber(L, (lua_Number)(ch_load(&ch->tail) - ch_load(&ch->head)));
     return 1;
 }
 
+static int mar_channel_gc(lua_State *L)
+{
+    mar_Channel **p = (mar_Channel**)luaL_checkudata(L, 1, MAR_CHANNEL);
+    if (*p) mar_channel_release(*p);
+    *p = NULL;
+    return 0;
+}
+
+static const luaL_reg channel_R[] =
+{
+    {"send",        mar_channel_send_l},
+    {"receive",     mar_channel_receive_l},
+    {"handle",      mar_channel_handle},
+    {"len",         mar_channel_len},
+    {"close",       mar_channel_gc},
+    {NULL,	    NULL}
+};
+#endif
+
+static const luaL_reg buffer_R[] =
+{
+    {"ptr",         mar_buffer_ptr},
+    {"len",         mar_buffer_len},
+    {"string",      mar_buffer_string},
+    {NULL,	    NULL}
+};
+
 static const luaL_reg R[] =
 {
     {"encode",      mar_encode},
     {"decode",      mar_decode},
+    {"decode_ptr",  mar_decode_ptr},
+    {"view",        mar_view},
+    {"get",         mar_get},
+    {"fill",        mar_fill},
     {"clone",       mar_clone},
+    {"encoder",     mar_encoder},
+    {"encode_to",   mar_encode_to},
+    {"decoder",     mar_decoder},
+    {"buffer",      mar_buffer},
+    {"encode_into", mar_encode_into},
+    {"encode_many", mar_encode_many},
+    {"decode_many", mar_decode_many},
+    {"diff",        mar_diff},
+    {"patch",       mar_patch_delta},
+    {"encode_file", mar_encode_file},
+    {"decode_file", mar_decode_file},
+    {"constants",   mar_constants},
+#ifdef MAR_STATS
+    {"stats",       mar_stats_get},
+#endif
+#ifdef MAR_THREADS
+    {"channel",     mar_channel},
+#endif
     {NULL,	    NULL}
 };
 
-int luaopen_marshal(lua_State *L)
+LUALIB_API int luaopen_marshal(lua_State *L)
 {
+    luaL_newmetatable(L, MAR_ENCODER);
+    lua_newtable(L);
+    luaL_register(L, NULL, encoder_R);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mar_encoder_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_DECODER);
+    lua_newtable(L);
+    luaL_register(L, NULL, decoder_R);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mar_decoder_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+#ifdef MAR_THREADS
+    luaL_newmetatable(L, MAR_CHANNEL);
+    lua_newtable(L);
+    luaL_register(L, NULL, channel_R);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mar_channel_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, mar_channel_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+#endif
+
+    luaL_newmetatable(L, MAR_FILE);
+    lua_pushcfunction(L, mar_file_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_MAP);
+    lua_pushcfunction(L, mar_map_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_CONSTANTS);
+    lua_pushcfunction(L, mar_constants_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, mar_constants_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_ARENA);
+    lua_pushcfunction(L, mar_arena_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_VIEW);
+    lua_pushcfunction(L, mar_view_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, MAR_BUFFER);
+    lua_newtable(L);
+    luaL_register(L, NULL, buffer_R);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, mar_buffer_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, mar_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_newtable(L);
     luaL_register(L, NULL, R);
     return 1;
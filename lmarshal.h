@@ -0,0 +1,74 @@
+/*
+* lmarshal.h
+* C interface of the marshal library, for moving values between Lua states
+* without going through Lua strings.
+*
+* License: MIT, see lmarshal.c
+*/
+
+#ifndef LMARSHAL_H
+#define LMARSHAL_H
+
+#include <stddef.h>
+
+#include "lua.h"
+
+/* Encoded bytes. The memory comes from malloc rather than the allocator of
+ * a state, so it can be handed to another state (or thread) and released
+ * there with mar_free_buffer. */
+typedef struct mar_Bytes {
+    char  *data;
+    size_t len;
+} mar_Bytes;
+
+/* Encodes the value at idx into buf, as marshal.encode does without
+ * constants or options. Returns 0, or the error code of lua_pcall with the
+ * error message pushed on the stack, in which case buf is not touched. */
+LUALIB_API int mar_encode_to_buffer(lua_State *L, int idx, mar_Bytes *buf);
+
+/* Decodes len bytes at data and pushes the value. Returns 0, or the error
+ * code of lua_pcall with the error message pushed instead. The memory is
+ * only read during the call. */
+LUALIB_API int mar_decode_from_buffer(lua_State *L, const char *data, size_t len);
+
+LUALIB_API void mar_free_buffer(mar_Bytes *buf);
+
+/* A userdata whose metatable has a __marshal field holding a light
+ * userdata that points at a hook is written as the size bytes its write
+ * stores at out, and decoded by read, which pushes a new userdata made from
+ * them. Neither calls into Lua unless it wants to. The metatable has to be
+ * in the constants on both ends: it is written in place of the hook. */
+typedef struct mar_Hook {
+    size_t size;
+    void (*write)(lua_State *L, int idx, char *out);
+    void (*read)(lua_State *L, const char *in);
+} mar_Hook;
+
+/* Channels (built with MAR_THREADS) carry messages from one producer to one
+ * consumer, usually two states on different threads, through a lock-free
+ * ring of encoded buffers. A channel lives while any state holds it. */
+#ifdef MAR_THREADS
+typedef struct mar_Channel mar_Channel;
+
+/* a new channel holding at most capacity messages, or NULL */
+LUALIB_API mar_Channel *mar_channel_new(size_t capacity);
+
+/* pushes a channel object for ch, which then holds a reference to it */
+LUALIB_API void mar_channel_push(lua_State *L, mar_Channel *ch);
+
+/* drops a reference taken by mar_channel_new */
+LUALIB_API void mar_channel_release(mar_Channel *ch);
+
+/* Queues msg, which the channel then owns, and returns 1, or returns 0 if
+ * the channel is full. Producer side only. */
+LUALIB_API int mar_channel_send(mar_Channel *ch, mar_Bytes *msg);
+
+/* Takes the oldest message into msg and returns 1, or returns 0 if there is
+ * none. The caller owns the message. Consumer side only. */
+LUALIB_API int mar_channel_receive(mar_Channel *ch, mar_Bytes *msg);
+#endif
+
+/* All of the above need the library to be loaded in the states they use. */
+LUALIB_API int luaopen_marshal(lua_State *L);
+
+#endif
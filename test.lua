@@ -1,12 +1,18 @@
 local marshal = require "marshal"
 
+-- Lua 5.2 and later
+local foreach = table.foreach or function(t, f)
+   for k, v in pairs(t) do f(k, v) end
+end
+newproxy = newproxy or marshal.buffer
+
 local k = { "tkey" }
 local a = { "a", "b", "c", [k] = "tval" }
 local s = assert(marshal.encode(a))
 --print(string.format("%q", s))
 local t = marshal.decode(s)
 --print(t)
-table.foreach(t, print)
+foreach(t, print)
 assert(t[1] == "a")
 assert(t[2] == "b")
 assert(t[3] == "c")
@@ -115,13 +121,21 @@ local s = marshal.encode{u}
 local t = marshal.decode(s)
 assert(type(t[1]) == "userdata")
 
+-- only a light userdata is a C hook, anything else leaves it to __persist
+local u = newproxy()
+debug.setmetatable(u, {
+   __marshal = true,
+   __persist = function() return function() return "persisted" end end
+})
+assert(marshal.decode(marshal.encode(u)) == "persisted")
+
 local t1 = { 1, 'a', b = 'b' }
-table.foreach(t1, print)
+foreach(t1, print)
 local t2 = marshal.clone(t1)
 print('---')
-table.foreach(t1, print)
+foreach(t1, print)
 print('---')
-table.foreach(t2, print)
+foreach(t2, print)
 assert(t1[1] == t2[1])
 assert(t1[2] == t2[2])
 assert(t1.b == t2.b)
@@ -139,19 +153,552 @@ assert(f2() == 'answer: 42')
 assert(marshal.decode(marshal.encode()) == nil)
 assert(marshal.decode(marshal.encode(nil)) == nil)
 
+local deep = { }
+local node = deep
+for i=1, 12 do
+   node.child = { depth = i, up = node }
+   node = node.child
+end
+local s = marshal.encode(deep)
+local t = marshal.decode(s)
+for i=1, 12 do
+   assert(t.child.depth == i)
+   assert(t.child.up == t)
+   t = t.child
+end
+assert(t.child == nil)
+
+local list = { }
+for i=1, 200000 do list = { i, next = list } end
+for _, opts in ipairs{ { }, { compact = true }, { shapes = true } } do
+   local t = marshal.decode(marshal.encode(list, nil, opts))
+   for i=200000, 1, -1 do
+      assert(t[1] == i)
+      t = t.next
+   end
+   assert(next(t) == nil)
+end
+local t = marshal.clone(list)
+for i=200000, 1, -1 do
+   assert(t[1] == i)
+   t = t.next
+end
+assert(next(t) == nil)
+local chunks = { }
+marshal.encode_to(list, function(s) chunks[#chunks + 1] = s end)
+assert(marshal.decode(table.concat(chunks))[1] == 200000)
+local key = { }
+for i=1, 5000 do key = { [key] = i } end
+local t = marshal.decode(marshal.encode(key))
+for i=5000, 1, -1 do
+   local k, v = next(t)
+   assert(v == i)
+   t = k
+end
+
+local Fresh = {
+   __persist = function(o)
+      collectgarbage()
+      local v = o.v
+      return function() return { v = v, junk = { } } end
+   end
+}
+local objs = { }
+for i=1, 200 do objs[i] = setmetatable({ v = i }, Fresh) end
+objs.again = objs[7]
+local t = marshal.decode(marshal.encode(objs))
+for i=1, 200 do assert(t[i].v == i) end
+assert(t.again == t[7])
+local pair = { "pair" }
+local enc = marshal.encoder()
+for round=1, 3 do
+   local t = marshal.decode(enc:encode({ objs[1], objs[2], { pair, pair } }))
+   assert(t[1].v == 1 and t[2].v == 2 and t[3][1] == t[3][2] and t[3][1] ~= pair)
+end
+local t = marshal.decode(marshal.encode({ print, pair, "s" }, { print, pair }), { print, pair })
+assert(t[1] == print and t[2] == pair and t[3] == "s")
+local K = marshal.constants({ print, "status", pair })
+assert(#K == 3)
+local v = { print, pair, "status", { pair } }
+local s = marshal.encode(v, K, { intern = 1 })
+assert(s == marshal.encode(v, { print, "status", pair }, { intern = 1 }))
+local t = marshal.decode(s, K)
+assert(t[1] == print and t[2] == pair and t[3] == "status" and t[4][1] == pair)
+assert(marshal.view(s, K)[4][1] == pair and marshal.clone(v, K)[4][1] == pair)
+assert(marshal.decode(marshal.encoder():encode(v, K), K)[2] == pair)
+assert(marshal.decode_many(marshal.encode_many({ { print }, { pair } }, K), K)[2][1] == pair)
+local dec = marshal.decoder(K)
+assert(dec:feed(s) and dec:result()[4][1] == pair)
+
+local arr = { }
+for i=1, 10000 do arr[i] = i * 2 end
+arr[10002] = "hole"
+arr[0] = "zero"
+arr[1.5] = "frac"
+arr.name = "arr"
+local t = marshal.decode(marshal.encode(arr))
+assert(#t == 10000)
+for i=1, 10000 do assert(t[i] == i * 2) end
+assert(t[10001] == nil)
+assert(t[10002] == "hole")
+assert(t[0] == "zero")
+assert(t[1.5] == "frac")
+assert(t.name == "arr")
+
+local zero = 0
+local nums = { 0, 1, -1, 127, 128, -129, 2^31, -2^31 - 1, 2^53, -2^53,
+   0.5, -1.25, 1e300, -zero, math.huge, -math.huge, string.rep("x", 300) }
+local rows = { }
+for i=1, 200 do rows[i] = { id = i, name = "row"..i, score = i / 4 } end
+nums.rows = rows
+local c = marshal.encode(nums, nil, { compact = true })
+assert(#c < #marshal.encode(nums))
+assert(#marshal.encode({ { } }, nil, { compact = true }) < #marshal.encode({ { } }))
+local t = marshal.decode(c)
+for i=1, #nums do assert(t[i] == nums[i]) end
+assert(1 / t[14] == -math.huge)
+for i=1, 200 do
+   assert(t.rows[i].id == i)
+   assert(t.rows[i].name == "row"..i)
+   assert(t.rows[i].score == i / 4)
+end
+local nan = marshal.decode(marshal.encode(0/0, nil, { compact = true }))
+assert(nan ~= nan)
+local t = marshal.decode(marshal.encode({ f = function() return up end }, nil, { compact = true }))
+assert(t.f() == up)
+
+local records = { }
+for i=1, 100 do
+   records[i] = { id = i, status = "pending", timestamp = 1e9 + i, ab = "ab" }
+end
+local s = marshal.encode(records, nil, { intern = true })
+assert(#s < #marshal.encode(records) / 2)
+local t = marshal.decode(s)
+for i=1, 100 do
+   assert(t[i].id == i)
+   assert(t[i].status == "pending")
+   assert(t[i].timestamp == 1e9 + i)
+   assert(t[i].ab == "ab")
+end
+local s = marshal.encode(records, nil, { intern = 1, compact = true })
+assert(marshal.decode(s)[100].status == "pending")
+local s = marshal.encode({ "status", "status" }, { "status" }, { intern = 1 })
+local t = marshal.decode(s, { "status" })
+assert(t[1] == "status" and t[2] == "status")
+
+local function counter(n)
+   return function() n = n + 1; return n end
+end
+local counters = { }
+for i=1, 50 do counters[i] = counter(i * 10) end
+local s = marshal.encode(counters)
+assert(#s < #string.dump(counters[1]) * 25)
+local t = marshal.decode(s)
+for i=1, 50 do
+   assert(t[i]() == i * 10 + 1)
+   assert(t[i]() == i * 10 + 2)
+end
+assert(t[1] ~= t[2])
+local t = marshal.decode(marshal.encode(counters, nil, { compact = true }))
+assert(t[50]() == 501)
+
+local shared = { "shared" }
+local orig = { a = shared, b = shared, n = 1, s = "str" }
+orig.self = orig
+orig.f = counter(100)
+orig.const = print
+orig.p = setmetatable({ v = 7 }, {
+   __persist = function(o)
+      local v = o.v
+      return function() return { v = v * 2 } end
+   end
+})
+orig.pp = orig.p
+local copy = marshal.clone(orig, { print })
+assert(copy ~= orig)
+assert(copy.self == copy)
+assert(copy.a ~= shared and copy.a[1] == "shared")
+assert(copy.a == copy.b)
+assert(copy.n == 1 and copy.s == "str")
+assert(copy.const == print)
+assert(copy.f ~= orig.f)
+assert(copy.f() == 101)
+assert(orig.f() == 101)
+assert(copy.p.v == 14)
+assert(copy.pp == copy.p)
+local t = marshal.decode(marshal.encode(orig, { print }), { print })
+assert(t.p.v == 14)
+assert(t.pp == t.p)
+assert(not pcall(marshal.clone, { print }))
+local loop = setmetatable({ }, {
+   __persist = function(o)
+      return function() return { self = o } end
+   end
+})
+assert(next(marshal.clone(loop)) == nil)
+assert(next(marshal.decode(marshal.encode(loop))) == nil)
+
+local chunks = { }
+local n = marshal.encode_to(orig, function(s) chunks[#chunks + 1] = s end, { print })
+local s = table.concat(chunks)
+assert(#s == n)
+local t = marshal.decode(s, { print })
+assert(t.self == t and t.a == t.b and t.const == print)
+assert(t.f() == 102 and t.p.v == 14 and t.pp == t.p)
+
+local chunks = { }
+local n = marshal.encode_to(arr, function(s) chunks[#chunks + 1] = s end, nil, { compact = true })
+assert(#chunks > 1)
+local t = marshal.decode(table.concat(chunks))
+assert(#t == 10000 and t[10000] == 20000 and t[10002] == "hole" and t.name == "arr")
+
+local f = io.tmpfile()
+marshal.encode_to(records, f, nil, { intern = true })
+f:seek("set")
+local t = marshal.decode(f:read("*a"))
+f:close()
+assert(#t == 100 and t[100].status == "pending")
+
+local function feed(s, step)
+   local dec = marshal.decoder({ print })
+   for i=1, #s, step do
+      local done = dec:feed(s:sub(i, i + step - 1))
+      assert(done == (i + step > #s))
+   end
+   return dec:result()
+end
+for _, s in ipairs{
+   marshal.encode(orig, { print }),
+   marshal.encode(orig, { print }, { compact = true, intern = true }),
+   (function()
+      local chunks = { }
+      marshal.encode_to(orig, function(s) chunks[#chunks + 1] = s end, { print })
+      return table.concat(chunks)
+   end)(),
+} do
+   for _, step in ipairs{ 1, 3, #s } do
+      local t = feed(s, step)
+      assert(t.self == t and t.a == t.b and t.const == print)
+      assert(t.p.v == 14 and t.pp == t.p)
+   end
+end
+local dec = marshal.decoder()
+assert(not pcall(dec.result, dec))
+assert(dec:feed(marshal.encode(42)) and dec:result() == 42)
+assert(not pcall(dec.feed, dec, "x"))
+
+assert(not pcall(marshal.decode_ptr, newproxy()))
+assert(not pcall(marshal.decode_ptr, newproxy(), 1))
+
+local buf = marshal.buffer()
+local n = marshal.encode_into(buf, orig, { print })
+assert(n == #buf and buf:string() == marshal.encode(orig, { print }))
+local t = marshal.decode_ptr(buf, nil, { print })
+assert(t.self == t and t.const == print and t.pp == t.p)
+local t = marshal.decode_ptr(buf:ptr(), buf:len(), { print })
+assert(t.self == t and t.const == print)
+assert(marshal.encode_into(buf, 42, nil, { compact = true }) < n)
+assert(marshal.decode_ptr(buf) == 42)
+assert(not pcall(marshal.decode_ptr, buf, #buf + 1))
+
+local rec = { id = 7, tags = { "a", "b" }, meta = { owner = "x" } }
+rec.meta.back = rec
+rec.alias = rec.tags
+for _, opts in ipairs{ { }, { compact = true, intern = true } } do
+   local v = marshal.view(marshal.encode(rec, nil, opts))
+   assert(rawget(v, "id") == nil and v.id == 7)
+   assert(rawget(v.tags, 1) == nil and v.tags[2] == "b" and #v.tags == 2)
+   assert(v.alias == v.tags and v.meta.back == v and v.meta.owner == "x")
+end
+local v = marshal.fill(marshal.view(marshal.encode(rec)))
+local n = 0
+for k in pairs(v) do n = n + 1 end
+assert(n == 4 and getmetatable(v) == nil)
+local v = marshal.view(marshal.encode(records, nil, { intern = true }))
+assert(v[100].status == "pending" and v[1].status == v[3].status)
+local v = marshal.view(marshal.encode({ print, { 1 } }, { print }), { print })
+assert(v[1] == print and v[2][1] == 1)
+assert(marshal.view(marshal.encode(orig, { print }), { print }).f() == 102)
+assert(marshal.view(marshal.encode(42)) == 42)
+
+local map = { list = { 1, 2, 3 }, name = "map", [1] = "one", [2.5] = { x = 1 } }
+for i=1, 100 do map["k"..i] = { id = i } end
+map.again = map.list
+for _, opts in ipairs{ { index = true }, { index = true, compact = true } } do
+   local s = marshal.encode(map, nil, opts)
+   assert(marshal.get(s, "k50").id == 50 and marshal.get(s, "name") == "map")
+   assert(marshal.get(s, 1) == "one" and marshal.get(s, 2.5).x == 1)
+   assert(marshal.get(s, "missing") == nil and marshal.get(s, "") == nil)
+   assert(marshal.get(s, "again")[3] == 3)
+   local t = marshal.decode(s)
+   assert(t.k100.id == 100 and t.again == t.list)
+   assert(marshal.view(s).k7.id == 7)
+   local dec = marshal.decoder()
+   for i=1, #s, 100 do dec:feed(s:sub(i, i + 99)) end
+   assert(dec:result().k3.id == 3)
+end
+assert(marshal.get(marshal.encode(map), "k9").id == 9)
+if math.type then
+   local s = marshal.encode({ [9007199254740992] = "a", [9007199254740993] = "b", [3] = "c" }, nil, { index = true })
+   assert(marshal.get(s, 9007199254740992) == "a" and marshal.get(s, 9007199254740993) == "b")
+   assert(marshal.get(s, 3.0) == "c" and marshal.get(s, 9007199254740994) == nil)
+end
+assert(marshal.get(marshal.encode(42, nil, { index = true }), "x") == nil)
+
+local rows = { }
+for i=1, 1000 do rows[i] = { id = i, name = "row"..i, score = i / 2, ok = i % 2 == 0 } end
+rows[500] = { id = 500, other = true }
+rows[501] = rows[1]
+rows.meta = { id = 0, name = "meta", score = 0, ok = false }
+for _, opts in ipairs{ { shapes = true }, { shapes = true, compact = true } } do
+   local s = marshal.encode(rows, nil, opts)
+   assert(#s < #marshal.encode(rows, nil, { compact = opts.compact }) * 0.7)
+   local t = marshal.decode(s)
+   assert(#t == 1000 and t[1000].name == "row1000" and t[999].ok == false)
+   assert(t[500].other and t[500].name == nil and t[501] == t[1])
+   assert(t.meta.name == "meta" and t[2].score == 1)
+   assert(marshal.view(s)[7].id == 7)
+   local dec = marshal.decoder()
+   for i=1, #s, 7 do dec:feed(s:sub(i, i + 6)) end
+   assert(dec:result()[42].name == "row42")
+end
+local chunks = { }
+marshal.encode_to(rows, function(s) chunks[#chunks + 1] = s end, nil, { shapes = true })
+assert(marshal.decode(table.concat(chunks))[3].name == "row3")
+local s = marshal.encode({ a = rows[3], b = rows[4], c = rows[5] }, nil, { shapes = true, index = true })
+assert(marshal.get(s, "a").id == 3 and marshal.get(s, "c").name == "row5")
+
+local big = { }
+for i=1, 5000 do big[i] = { id = i, name = "row"..i, tags = { "a", "b", "c" } } end
+local noise = { }
+for i=1, 20000 do noise[i] = string.char(math.random(0, 255)) end
+big.noise = table.concat(noise)
+for _, opts in ipairs{ { compress = true }, { compress = true, compact = true, index = true } } do
+   local s = marshal.encode(big, nil, opts)
+   local plain = marshal.encode(big, nil, { compact = opts.compact, index = opts.index })
+   assert(#s < #plain / 2)
+   local t = marshal.decode(s)
+   assert(#t == 5000 and t[4321].name == "row4321" and t[17].tags[3] == "c")
+   assert(t.noise == big.noise)
+   assert(marshal.get(s, 99).id == 99)
+   assert(marshal.view(s)[123].name == "row123")
+   local dec = marshal.decoder()
+   local done
+   for i=1, #s, 1000 do done = dec:feed(s:sub(i, i + 999)) end
+   assert(done and dec:result()[5000].id == 5000)
+   local enc = marshal.encoder(opts)
+   assert(enc:encode(big) == s)
+   local buf = marshal.buffer()
+   assert(marshal.encode_into(buf, big, nil, opts) == #s and buf:string() == s)
+   local chunks = { }
+   marshal.encode_to(big, function(c) chunks[#chunks + 1] = c end, nil, opts)
+   assert(marshal.decode(table.concat(chunks))[2500].name == "row2500")
+end
+local s = marshal.encode(big, nil, { compress = true, threads = 4 })
+assert(s == marshal.encode(big, nil, { compress = true }))
+assert(marshal.encoder{ compress = true, threads = 3 }:encode(big) == s)
+assert(not pcall(marshal.encode, big, nil, { threads = 4 }))
+assert(marshal.decode_many(marshal.encode_many({ big, big }, nil, { compress = true, threads = 2 }))[2][77].id == 77)
+assert(marshal.decode(marshal.encode("", nil, { compress = true })) == "")
+assert(not pcall(marshal.decode, marshal.encode(big, nil, { compress = true }):sub(1, 100)))
+
+-- fixed widths are little-endian on every host
+assert(marshal.encode(1.5) == "\143\3\0\0\0\0\0\0\248\63")
+assert(marshal.encode("ab") == "\143\4\2\0\0\0ab")
+assert(marshal.encode(true) == "\143\1\1")
+assert(select(2, pcall(marshal.decode, "\142\1\1")):find("unsupported format version"))
+local data = { n = 1.25, s = "x", list = { 1, 2, 3 }, flag = false }
+local t = marshal.decode(marshal.encode(data, nil, { portable = true }))
+assert(t.n == 1.25 and t.s == "x" and t.list[3] == 3 and t.flag == false)
+assert(not pcall(marshal.encode, { f = function() end }, nil, { portable = true }))
+assert(not pcall(marshal.encode, orig, nil, { portable = true }))
+assert(marshal.decode(marshal.encode({ print }, { print }, { portable = true }), { print })[1] == print)
+
+local x, none = 5, nil
+local fs = {
+   function() return x .. tostring(x) end,
+   function() return tostring(x) .. x end,
+   function() return none, type(none) end,
+}
+local t = marshal.decode(marshal.encode(fs))
+assert(t[1]() == "55" and t[2]() == "55")
+local a, b = t[3]()
+assert(a == nil and b == "nil")
+assert(marshal.clone(fs)[2]() == "55")
+if math.type then
+   local t = marshal.decode(marshal.encode({ 1, 2^53, math.maxinteger, math.mininteger, 3.0, -0.0 }))
+   assert(math.type(t[1]) == "integer" and t[3] == math.maxinteger and t[4] == math.mininteger)
+   assert(math.type(t[2]) == "float" and math.type(t[5]) == "float" and 1 / t[6] < 0)
+   assert(#marshal.encode(7) == 3)
+   local t = marshal.decode(marshal.encode({ 3.0, 4 }, nil, { compact = true }))
+   assert(math.type(t[1]) == "float" and math.type(t[2]) == "integer")
+end
+
+local shared = { "common" }
+local msgs = { { id = 1, ref = shared }, { id = 2, ref = shared }, "three", shared }
+for _, opts in ipairs{ { }, { compact = true, intern = true }, { compress = true, shapes = true } } do
+   local t = marshal.decode_many(marshal.encode_many(msgs, nil, opts))
+   assert(#t == 4 and t[1].id == 1 and t[2].ref[1] == "common" and t[3] == "three")
+   assert(t[1].ref ~= t[2].ref and t[4] ~= t[1].ref)
+   opts.shared = true
+   local t = marshal.decode_many(marshal.encode_many(msgs, nil, opts))
+   assert(t[1].ref == t[2].ref and t[4] == t[1].ref)
+end
+local t = marshal.decode_many(marshal.encode_many({ { print }, print }, { print }), { print })
+assert(t[1][1] == print and t[2] == print)
+assert(#marshal.decode_many(marshal.encode_many({ })) == 0)
+assert(marshal.decode_many(marshal.encode(msgs[1]))[1].id == 1)
+assert(not pcall(marshal.decode, marshal.encode_many(msgs)))
+assert(not pcall(marshal.decode_many, marshal.encode_many(msgs):sub(1, -2)))
+
+local series, words, mixed = { }, { }, { }
+for i=1, 1000 do
+   series[i] = i + 0.25
+   words[i] = "w"..(i % 37)
+   mixed[i] = i % 2 == 0 and i + 0.5 or "x"
+end
+local arrays = { series = series, words = words, mixed = mixed, same = series, short = { 1.5, 2.5 } }
+for _, opts in ipairs{ { }, { compact = true }, { compress = true } } do
+   local s = marshal.encode(arrays, nil, opts)
+   for _, t in ipairs{ marshal.decode(s), marshal.view(s) } do
+      assert(t.series[1000] == 1000.25 and #t.series == 1000 and t.same == t.series)
+      assert(t.words[37] == "w0" and t.mixed[2] == 2.5 and t.mixed[3] == "x")
+      assert(t.short[2] == 2.5)
+   end
+   local dec = marshal.decoder()
+   for i=1, #s, 333 do dec:feed(s:sub(i, i + 332)) end
+   assert(dec:result().words[1000] == "w1")
+   local chunks = { }
+   marshal.encode_to(arrays, function(c) chunks[#chunks + 1] = c end, nil, opts)
+   assert(marshal.decode(table.concat(chunks)).series[500] == 500.25)
+end
+assert(#marshal.encode(series) < 1000 * 8 + 32)
+local ints = { }
+for i=1, 100 do ints[i] = i * 3 end
+local t = marshal.decode(marshal.encode(ints, nil, { compact = true }))
+assert(#t == 100 and t[100] == 300)
+assert(#marshal.encode(ints, nil, { compact = true }) < 250)
+local holes = { 1.5, 2.5, 3.5, 4.5, 5.5, 6.5, 7.5, 8.5, 9.5 }
+holes[5] = nil
+local t = marshal.decode(marshal.encode(holes))
+assert(t[5] == nil and t[9] == 9.5)
+assert(not pcall(marshal.decode, marshal.encode(series):sub(1, -2)))
+
+-- the memory of a call that fails goes back with its arena
+local before = collectgarbage("count")
+for i=1, 50 do assert(not pcall(marshal.encode, { big, big.noise, print }, nil, { index = true })) end
+collectgarbage()
+assert(collectgarbage("count") < before + 1024)
+
+if marshal.stats then
+   marshal.stats(true)
+   local shared = { }
+   marshal.encode({ shared, shared, { "abc", 1.5 }, function() end })
+   local st = marshal.stats(true)
+   assert(st.encodes == 1 and st.tables == 3 and st.functions == 1 and st.refs == 1)
+   assert(st.depth == 2 and st.bytes.string == 1 + 4 + 3 and st.bytes.number == 9)
+   assert(marshal.stats().encodes == 0)
+end
+
+local old = { name = "a", n = 1, list = { 1, 2, 3 }, deep = { x = { y = 1 } }, gone = true }
+old.self = old
+for i=1, 100 do old[i] = { id = i, tag = "row" } end
+local snap = marshal.encode(old)
+local new = marshal.decode(snap)
+new.n = 2
+new.list[4] = 4
+new.gone = nil
+new.deep.x.y = 2
+new.added = { "z" }
+local delta = marshal.diff(snap, new)
+assert(#delta < #marshal.encode(new))
+assert(not pcall(marshal.decode, delta) and not pcall(marshal.patch, { }, snap))
+local target = marshal.decode(snap)
+local keep = target.deep
+assert(marshal.patch(target, delta) == target)
+assert(target.n == 2 and target.list[4] == 4 and target.gone == nil and target.deep.x.y == 2)
+assert(target.added[1] == "z" and target.self == target and target.deep == keep)
+assert(target[100].id == 100)
+assert(marshal.patch(new, marshal.diff(new, marshal.decode(snap))).n == 1 and new.gone)
+assert(next(marshal.patch({ }, marshal.diff(snap, marshal.decode(snap)))) == nil)
+assert(marshal.patch(1, marshal.diff(1, { 5 }))[1] == 5)
+local new = marshal.decode(snap)
+new.x = new.deep
+new.back = new
+new[101] = { id = 101, up = new[100], list = { new.list } }
+local delta = marshal.diff(snap, new)
+assert(#delta < #snap)
+local target = marshal.decode(snap)
+marshal.patch(target, delta)
+assert(rawequal(target.x, target.deep) and rawequal(target.back, target))
+assert(rawequal(target[101].up, target[100]) and rawequal(target[101].list[1], target.list))
+assert(target.x.x.y == 1 and target[101].id == 101)
+
+local path = os.tmpname()
+local state = { name = "state", list = { } }
+for i=1, 5000 do state.list[i] = { id = i, tag = "item"..i } end
+local n = marshal.encode_file(path, state, nil, { compress = true })
+local f = assert(io.open(path, "rb"))
+assert(#f:read("*a") == n)
+f:close()
+local t = marshal.decode_file(path)
+assert(t.name == "state" and t.list[5000].tag == "item5000")
+marshal.encode_file(path, { print, "x" }, { print })
+assert(marshal.decode_file(path, { print })[1] == print)
+assert(not pcall(marshal.encode_file, path, { "y", coroutine.create(print) }))
+assert(marshal.decode_file(path, { print })[2] == "x" and not io.open(path..".tmp"))
+os.remove(path)
+assert(not pcall(marshal.decode_file, path))
+
+if marshal.channel then
+   local ch = marshal.channel(2)
+   local t = { id = 7 }
+   assert(ch:send({ t, t, name = "x" }))
+   assert(ch:send({ print }, { print }))
+   assert(not ch:send(1))
+   assert(#ch == 2)
+   local ok, v = ch:receive()
+   assert(ok and v[1] == v[2] and v[1].id == 7 and v.name == "x")
+   local other = marshal.channel(ch:handle())
+   local ok, v = other:receive({ print })
+   assert(ok and v[1] == print)
+   assert(not ch:receive() and #other == 0)
+   assert(not pcall(ch.send, ch, print))
+   assert(ch:send("after"))
+   assert(select(2, other:receive()) == "after")
+   local gone = marshal.channel(1)
+   local h = gone:handle()
+   gone:close()
+   assert(not pcall(marshal.channel, h))
+   assert(not pcall(marshal.channel, marshal.buffer(16):ptr()))
+end
+
+local a, b, c = 1, nil, 3
+local function holes() return a, b, c end
+local x, y, z = marshal.decode(marshal.encode(holes))()
+assert(x == 1 and y == nil and z == 3)
+
+local enc = marshal.encoder()
+local big = { }
+for i=1, 1000 do big[i] = "item"..i end
+local s = enc:encode(big)
+assert(s == marshal.encode(big))
+local small = { answer = 42 }
+local s = enc:encode(small)
+assert(s == marshal.encode(small))
+assert(marshal.decode(s).answer == 42)
+local s = enc:encode({ print, 42 }, { print })
+assert(marshal.decode(s, { print })[1] == print)
+local s = enc:encode(small)
+assert(marshal.decode(s).answer == 42)
+local enc = marshal.encoder{ compact = true }
+assert(enc:encode(nums) == c)
+
 local s1 = marshal.encode(pt)
 local p2 = marshal.decode(s1)
 print(string.format('%q',s1))
 
 print "OK"
 
---[[ micro-bench (~4.2 seconds on my laptop)
-local t = { a='a', b='b', c='c', d='d', hop='jump', skip='foo', answer=42 }
-local s = marshal.encode(t)
-for i=1, 1000000 do
-   s = marshal.encode(t)
-   t = marshal.decode(s)
-end
---]]
 --]==]
 